@@ -83,7 +83,8 @@ LOCAL_MODULE_TAGS := optional
 
 LOCAL_SRC_FILES := \
 	gralloc_drm.c \
-	gralloc_drm_kms.c
+	gralloc_drm_kms.c \
+	gralloc_drm_scale.c
 
 LOCAL_C_INCLUDES := \
 	external/drm \
@@ -95,6 +96,11 @@ LOCAL_SHARED_LIBRARIES := \
 	libcutils \
 	libhardware_legacy \
 
+# libdrm 2.4.65 and later read connectors without probing them
+ifeq ($(strip $(DRM_HAS_GET_CONNECTOR_CURRENT)),true)
+LOCAL_CFLAGS += -DHAVE_DRM_GET_CONNECTOR_CURRENT
+endif
+
 ifneq ($(filter $(intel_drivers), $(DRM_GPU_DRIVERS)),)
 LOCAL_SRC_FILES += gralloc_drm_intel.c
 LOCAL_C_INCLUDES += external/drm/intel
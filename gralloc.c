@@ -32,6 +32,12 @@
 #include "gralloc_drm.h"
 #include "gralloc_drm_priv.h"
 
+/* the fb device of an extended output, "fb<display>" */
+struct drm_fb_device_t {
+	struct framebuffer_device_t base;
+	int disp;
+};
+
 /*
  * Initialize the DRM device object, optionally with KMS.
  */
@@ -315,6 +321,60 @@ static int drm_mod_open_fb0(struct drm_module_t *dmod, struct hw_device_t **dev)
 	return 0;
 }
 
+static int drm_mod_post_fbn(struct framebuffer_device_t *fb,
+		buffer_handle_t handle)
+{
+	struct drm_fb_device_t *fbn = (struct drm_fb_device_t *) fb;
+	struct gralloc_drm_bo_t *bo;
+
+	bo = gralloc_drm_bo_from_handle(handle);
+	if (!bo)
+		return -EINVAL;
+
+	return gralloc_drm_bo_post_display(bo, fbn->disp);
+}
+
+static int drm_mod_open_fbn(struct drm_module_t *dmod, int disp,
+		struct hw_device_t **dev)
+{
+	struct drm_fb_device_t *fbn;
+	struct framebuffer_device_t *fb;
+	int err;
+
+	err = drm_init(dmod, 1);
+	if (err)
+		return err;
+
+	fbn = calloc(1, sizeof(*fbn));
+	if (!fbn)
+		return -ENOMEM;
+	fbn->disp = disp;
+	fb = &fbn->base;
+
+	fb->common.tag = HARDWARE_DEVICE_TAG;
+	fb->common.version = 0;
+	fb->common.module = &dmod->base.common;
+	fb->common.close = drm_mod_close_fb0;
+
+	fb->setSwapInterval = drm_mod_set_swap_interval_fb0;
+	fb->post = drm_mod_post_fbn;
+	fb->compositionComplete = drm_mod_composition_complete_fb0;
+
+	/* only extended outputs have a fb device */
+	err = gralloc_drm_get_display_kms_info(dmod->drm, disp, fb);
+	if (err) {
+		free(fbn);
+		return err;
+	}
+
+	*dev = &fb->common;
+
+	ALOGI("display %d mode.hdisplay %d mode.vdisplay %d mode.vrefresh %f",
+	     disp, fb->width, fb->height, fb->fps);
+
+	return 0;
+}
+
 static int drm_mod_open(const struct hw_module_t *mod,
 		const char *name, struct hw_device_t **dev)
 {
@@ -325,6 +385,8 @@ static int drm_mod_open(const struct hw_module_t *mod,
 		err = drm_mod_open_gpu0(dmod, dev);
 	else if (strcmp(name, GRALLOC_HARDWARE_FB0) == 0)
 		err = drm_mod_open_fb0(dmod, dev);
+	else if (strncmp(name, "fb", 2) == 0 && atoi(name + 2) > 0)
+		err = drm_mod_open_fbn(dmod, atoi(name + 2), dev);
 	else
 		err = -EINVAL;
 
@@ -354,7 +416,25 @@ struct drm_module_t HAL_MODULE_INFO_SYM = {
 	},
 	.hwc_reserve_plane = gralloc_drm_reserve_plane,
 	.hwc_disable_planes = gralloc_drm_disable_planes,
+	.hwc_reserve_display_plane = gralloc_drm_reserve_display_plane,
 	.hwc_set_plane_handle = gralloc_drm_set_plane_handle,
+	.hwc_get_plane_count = gralloc_drm_get_plane_count,
+	.hwc_get_plane_caps = gralloc_drm_get_plane_caps,
+	.hwc_validate_plane = gralloc_drm_validate_plane,
+	.hwc_get_render_size = gralloc_drm_get_render_size,
+	.hwc_get_buffer_render_size = gralloc_drm_get_buffer_render_size,
+	.hwc_get_cursor_size = gralloc_drm_get_cursor_size,
+	.hwc_set_cursor = gralloc_drm_set_cursor,
+	.hwc_move_cursor = gralloc_drm_move_cursor,
+	.hwc_get_refresh_rates = gralloc_drm_get_refresh_rates,
+	.hwc_set_refresh_rate = gralloc_drm_set_refresh_rate,
+	.hwc_post_damage = gralloc_drm_post_damage,
+	.hwc_get_next_vblank = gralloc_drm_get_next_vblank,
+	.hwc_set_vsync_callback = gralloc_drm_set_vsync_callback,
+	.hwc_shutdown = gralloc_drm_shutdown_kms,
+	.hwc_get_event_fd = gralloc_drm_get_event_fd,
+	.hwc_handle_events = gralloc_drm_handle_events,
+	.hwc_set_event_callbacks = gralloc_drm_set_event_callbacks,
 
 	.mutex = PTHREAD_MUTEX_INITIALIZER,
 	.drm = NULL
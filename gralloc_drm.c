@@ -108,6 +108,14 @@ struct gralloc_drm_t *gralloc_drm_create(void)
 	if (!drm)
 		return NULL;
 
+	drm->event_pipe[0] = drm->event_pipe[1] = -1;
+	drm->hotplug_pipe[0] = drm->hotplug_pipe[1] = -1;
+	drm->shutdown_pipe[0] = drm->shutdown_pipe[1] = -1;
+	drm->event_fd = -1;
+	drm->uevent_fd = -1;
+	pthread_mutex_init(&drm->blit_mutex, NULL);
+	pthread_mutex_init(&drm->fb_cache_mutex, NULL);
+
 	drm->fd = open(GRALLOC_DRM_DEVICE, O_RDWR);
 	if (drm->fd < 0) {
 		ALOGE("failed to open %s", GRALLOC_DRM_DEVICE);
@@ -325,12 +333,21 @@ static void gralloc_drm_bo_destroy(struct gralloc_drm_bo_t *bo)
 	}
 }
 
+/*
+ * Increase refcount.  References are taken and dropped by the app, event
+ * and clone threads, so the count is atomic.
+ */
+void gralloc_drm_bo_incref(struct gralloc_drm_bo_t *bo)
+{
+	android_atomic_inc(&bo->refcount);
+}
+
 /*
  * Decrease refcount, if no refs anymore then destroy.
  */
 void gralloc_drm_bo_decref(struct gralloc_drm_bo_t *bo)
 {
-	if (!--bo->refcount)
+	if (android_atomic_dec(&bo->refcount) == 1)
 		gralloc_drm_bo_destroy(bo);
 }
 
@@ -35,6 +35,30 @@ extern "C" {
 
 struct gralloc_drm_t;
 struct gralloc_drm_bo_t;
+struct drm_clip_rect;
+
+/*
+ * display event callbacks, disp is 0 for primary, 1 for hdmi and 2 on for
+ * the other extended outputs
+ */
+struct gralloc_drm_event_callbacks_t {
+	void (*flip)(void *data, int disp, unsigned int sequence, int64_t timestamp);
+	void (*vblank)(void *data, int disp, unsigned int sequence, int64_t timestamp);
+	void (*hotplug)(void *data, int disp, int connected);
+	/* the primary swapchain should now be rendered at width x height */
+	void (*resize)(void *data, int disp, uint32_t width, uint32_t height);
+};
+
+/* what a plane can do, as reported by gralloc_drm_get_plane_caps */
+struct gralloc_drm_plane_caps_t {
+	uint32_t plane_id;
+	uint32_t displays;		/* bit per display the plane can be used on */
+	const uint32_t *formats;	/* drm formats */
+	uint32_t count_formats;
+	int zpos;			/* -1 if the plane has no zpos */
+	int scaling;			/* 0 if the plane is known not to scale */
+	uint64_t rotations;		/* bits of the rotation property, 0 if none */
+};
 
 struct gralloc_drm_t *gralloc_drm_create(void);
 void gralloc_drm_destroy(struct gralloc_drm_t *drm);
@@ -47,9 +71,11 @@ void gralloc_drm_drop_master(struct gralloc_drm_t *drm);
 
 int gralloc_drm_init_kms(struct gralloc_drm_t *drm);
 void gralloc_drm_fini_kms(struct gralloc_drm_t *drm);
+void gralloc_drm_shutdown_kms(struct gralloc_drm_t *drm);
 int gralloc_drm_is_kms_initialized(struct gralloc_drm_t *drm);
 
 void gralloc_drm_get_kms_info(struct gralloc_drm_t *drm, struct framebuffer_device_t *fb);
+int gralloc_drm_get_display_kms_info(struct gralloc_drm_t *drm, int disp, struct framebuffer_device_t *fb);
 int gralloc_drm_is_kms_pipelined(struct gralloc_drm_t *drm);
 
 static inline int gralloc_drm_get_bpp(int format)
@@ -120,6 +146,7 @@ int gralloc_drm_handle_register(buffer_handle_t handle, struct gralloc_drm_t *dr
 int gralloc_drm_handle_unregister(buffer_handle_t handle);
 
 struct gralloc_drm_bo_t *gralloc_drm_bo_create(struct gralloc_drm_t *drm, int width, int height, int format, int usage);
+void gralloc_drm_bo_incref(struct gralloc_drm_bo_t *bo);
 void gralloc_drm_bo_decref(struct gralloc_drm_bo_t *bo);
 
 struct gralloc_drm_bo_t *gralloc_drm_bo_from_handle(buffer_handle_t handle);
@@ -131,18 +158,74 @@ unsigned int planes_for_format(struct gralloc_drm_t *drm, int hal_format);
 int gralloc_drm_bo_lock(struct gralloc_drm_bo_t *bo, int x, int y, int w, int h, int enable_write, void **addr);
 void gralloc_drm_bo_unlock(struct gralloc_drm_bo_t *bo);
 
+void gralloc_drm_bo_blit(struct gralloc_drm_bo_t *dst,
+		struct gralloc_drm_bo_t *src,
+		uint16_t dst_x1, uint16_t dst_y1, uint16_t dst_x2, uint16_t dst_y2,
+		uint16_t src_x1, uint16_t src_y1, uint16_t src_x2, uint16_t src_y2);
+int gralloc_drm_bo_scale(struct gralloc_drm_bo_t *dst,
+		struct gralloc_drm_bo_t *src,
+		int dst_x, int dst_y, int dst_w, int dst_h,
+		int src_x, int src_y, int src_w, int src_h);
+
 int gralloc_drm_bo_need_fb(const struct gralloc_drm_bo_t *bo);
 int gralloc_drm_bo_add_fb(struct gralloc_drm_bo_t *bo);
 void gralloc_drm_bo_rm_fb(struct gralloc_drm_bo_t *bo);
 int gralloc_drm_bo_post(struct gralloc_drm_bo_t *bo);
+int gralloc_drm_bo_post_damage(struct gralloc_drm_bo_t *bo,
+	const struct drm_clip_rect *rects, int count);
+int gralloc_drm_bo_post_display(struct gralloc_drm_bo_t *bo, int disp);
 
 int gralloc_drm_reserve_plane(struct gralloc_drm_t *drm,
 	buffer_handle_t handle, uint32_t id,
 	uint32_t dst_x, uint32_t dst_y, uint32_t dst_w, uint32_t dst_h,
 	uint32_t src_x, uint32_t src_y, uint32_t src_w, uint32_t src_h);
+int gralloc_drm_reserve_display_plane(struct gralloc_drm_t *drm,
+	int disp, buffer_handle_t handle, uint32_t id,
+	uint32_t dst_x, uint32_t dst_y, uint32_t dst_w, uint32_t dst_h,
+	uint32_t src_x, uint32_t src_y, uint32_t src_w, uint32_t src_h);
 void gralloc_drm_disable_planes(struct gralloc_drm_t *mod);
 int gralloc_drm_set_plane_handle(struct gralloc_drm_t *drm,
 	uint32_t id, buffer_handle_t handle);
+int gralloc_drm_get_plane_count(struct gralloc_drm_t *drm);
+int gralloc_drm_get_plane_caps(struct gralloc_drm_t *drm, int index,
+	struct gralloc_drm_plane_caps_t *caps);
+int gralloc_drm_validate_plane(struct gralloc_drm_t *drm,
+	int disp, uint32_t plane_id, buffer_handle_t handle,
+	uint32_t dst_x, uint32_t dst_y, uint32_t dst_w, uint32_t dst_h,
+	uint32_t src_x, uint32_t src_y, uint32_t src_w, uint32_t src_h);
+
+void gralloc_drm_get_render_size(struct gralloc_drm_t *drm,
+	uint32_t *width, uint32_t *height);
+int gralloc_drm_get_buffer_render_size(struct gralloc_drm_t *drm,
+	buffer_handle_t handle, uint32_t *width, uint32_t *height);
+
+void gralloc_drm_get_cursor_size(struct gralloc_drm_t *drm,
+	uint32_t *width, uint32_t *height);
+int gralloc_drm_set_cursor(struct gralloc_drm_t *drm, int disp,
+	buffer_handle_t handle, int hot_x, int hot_y);
+int gralloc_drm_move_cursor(struct gralloc_drm_t *drm, int disp,
+	int x, int y);
+
+int gralloc_drm_get_refresh_rates(struct gralloc_drm_t *drm, int disp,
+	int *rates, int count);
+int gralloc_drm_set_refresh_rate(struct gralloc_drm_t *drm, int disp,
+	int rate);
+
+int gralloc_drm_post_damage(struct gralloc_drm_t *drm,
+	buffer_handle_t handle, const struct drm_clip_rect *rects, int count);
+
+int gralloc_drm_get_next_vblank(struct gralloc_drm_t *drm,
+	int disp, int64_t *timestamp);
+int gralloc_drm_set_vsync_callback(struct gralloc_drm_t *drm,
+	int disp, int64_t offset,
+	void (*callback)(void *data, int disp, int64_t timestamp),
+	void *data);
+
+int gralloc_drm_get_event_fd(struct gralloc_drm_t *drm);
+int gralloc_drm_handle_events(struct gralloc_drm_t *drm);
+void gralloc_drm_set_event_callbacks(struct gralloc_drm_t *drm,
+	const struct gralloc_drm_event_callbacks_t *callbacks,
+	void *data);
 
 #ifdef __cplusplus
 }
@@ -44,7 +44,7 @@ struct gralloc_drm_handle_t {
 	int format;
 	int usage;
 
-	unsigned int plane_mask; /* planes that support handle */
+	unsigned int plane_mask; /* planes that support handle, by index */
 
 	int name;   /* the name of the bo */
 	int stride; /* the stride in bytes */
@@ -26,15 +26,21 @@
 #include <cutils/properties.h>
 #include <cutils/log.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <poll.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/utsname.h>
+#include <linux/netlink.h>
 #include <math.h>
 #include "gralloc_drm.h"
 #include "gralloc_drm_priv.h"
-#include <hardware_legacy/uevent.h>
 
 #include <drm_fourcc.h>
 
@@ -88,6 +94,19 @@ static int resolve_drm_format(struct gralloc_drm_bo_t *bo,
 	return drm_format_from_hal(bo->handle->format);
 }
 
+/*
+ * Return the bit of a plane in plane masks.  Planes are told by their index
+ * in the plane resources, as object ids can be any number; the planes past
+ * the width of the mask are never used for handles.
+ */
+static unsigned int drm_kms_plane_bit(const struct gralloc_drm_t *drm,
+	const struct gralloc_drm_plane_t *plane)
+{
+	unsigned int index = plane - drm->planes;
+
+	return (index < sizeof(unsigned int) * 8) ? (1U << index) : 0;
+}
+
 /*
  * Returns planes that are supported for a particular format
  */
@@ -103,48 +122,184 @@ unsigned int planes_for_format(struct gralloc_drm_t *drm,
 		return 0;
 
 	/* iterate through planes, mark those that match format */
-	for (i=0; i<drm->plane_resources->count_planes; i++, plane++)
+	for (i=0; i<drm->plane_resources->count_planes; i++, plane++) {
+		if (!plane->overlay)
+			continue;
 		for (j=0; j<plane->drm_plane->count_formats; j++)
 			if (plane->drm_plane->formats[j] == drm_format)
-				mask |= (1U << plane->drm_plane->plane_id);
+				mask |= drm_kms_plane_bit(drm, plane);
+	}
 
 	return mask;
 }
 
 /*
- * Add a fb object for a bo.
+ * Drop a cached fb object and the GEM handle that keeps its name alive.
+ * The caller must hold fb_cache_mutex.
+ */
+static void drm_kms_fb_cache_evict(struct gralloc_drm_t *drm,
+		struct gralloc_drm_fb_t *fb)
+{
+	struct drm_gem_close gem_close;
+
+	drmModeRmFB(drm->fd, fb->fb_id);
+
+	memset(&gem_close, 0, sizeof(gem_close));
+	gem_close.handle = fb->gem_handle;
+	drmIoctl(drm->fd, DRM_IOCTL_GEM_CLOSE, &gem_close);
+
+	memset(fb, 0, sizeof(*fb));
+}
+
+/*
+ * Find the cached fb object for a key, or a slot to cache a new one in: a
+ * free slot, else the least recently used fb no bo uses, which is evicted.
+ * The caller must hold fb_cache_mutex.
+ */
+static struct gralloc_drm_fb_t *drm_kms_fb_cache_lookup(
+		struct gralloc_drm_t *drm, const struct gralloc_drm_fb_t *key,
+		struct gralloc_drm_fb_t **slot)
+{
+	struct gralloc_drm_fb_t *fb;
+	int i;
+
+	*slot = NULL;
+	for (i = 0; i < GRALLOC_DRM_FB_CACHE_SIZE; i++) {
+		fb = &drm->fb_cache[i];
+
+		if (fb->fb_id &&
+		    fb->name == key->name &&
+		    fb->format == key->format &&
+		    fb->width == key->width &&
+		    fb->height == key->height &&
+		    !memcmp(fb->pitches, key->pitches, sizeof(key->pitches)) &&
+		    !memcmp(fb->offsets, key->offsets, sizeof(key->offsets))) {
+			fb->stamp = ++drm->fb_cache_stamp;
+			return fb;
+		}
+
+		if (fb->users)
+			continue;
+		if (!*slot || !fb->fb_id ||
+		    ((*slot)->fb_id && fb->stamp < (*slot)->stamp))
+			*slot = fb;
+	}
+
+	if (*slot && (*slot)->fb_id)
+		drm_kms_fb_cache_evict(drm, *slot);
+
+	return NULL;
+}
+
+/*
+ * Add a fb object for a bo.  fb objects are cached by flink name, so that
+ * a buffer registered again, such as a decoder buffer, reuses its fb.  A
+ * fb does not keep the name alive, as the kernel frees it with the last
+ * GEM handle and may give it to another buffer; the cache opens its own
+ * handle of the name, and a cached fb outlives its bos until evicted.
  */
 int gralloc_drm_bo_add_fb(struct gralloc_drm_bo_t *bo)
 {
-	uint32_t pitches[4] = { 0, 0, 0, 0 };
-	uint32_t offsets[4] = { 0, 0, 0, 0 };
+	struct gralloc_drm_t *drm = bo->drm;
 	uint32_t handles[4] = { 0, 0, 0, 0 };
+	struct gralloc_drm_fb_t key, *fb, *slot;
+	struct drm_gem_open gem_open;
+	int err;
 
 	if (bo->fb_id)
 		return 0;
 
-	int drm_format = resolve_drm_format(bo, pitches, offsets, handles);
+	memset(&key, 0, sizeof(key));
+	key.format = resolve_drm_format(bo, key.pitches, key.offsets, handles);
 
-	if (drm_format == 0) {
+	if (key.format == 0) {
 		ALOGE("error resolving drm format");
 		return -EINVAL;
 	}
 
-	return drmModeAddFB2(bo->drm->fd,
-		bo->handle->width, bo->handle->height,
-		drm_format, handles, pitches, offsets,
+	key.name = bo->handle->name;
+	key.width = bo->handle->width;
+	key.height = bo->handle->height;
+
+	pthread_mutex_lock(&drm->fb_cache_mutex);
+
+	fb = (key.name) ? drm_kms_fb_cache_lookup(drm, &key, &slot) : NULL;
+	if (fb) {
+		fb->users++;
+		bo->fb_id = fb->fb_id;
+		pthread_mutex_unlock(&drm->fb_cache_mutex);
+		return 0;
+	}
+
+	err = drmModeAddFB2(drm->fd,
+		key.width, key.height,
+		key.format, handles, key.pitches, key.offsets,
 		(uint32_t *) &bo->fb_id, 0);
+
+	/* cached only when the name can be held */
+	if (!err && key.name && slot) {
+		memset(&gem_open, 0, sizeof(gem_open));
+		gem_open.name = key.name;
+		if (!drmIoctl(drm->fd, DRM_IOCTL_GEM_OPEN, &gem_open)) {
+			*slot = key;
+			slot->gem_handle = gem_open.handle;
+			slot->fb_id = bo->fb_id;
+			slot->users = 1;
+			slot->stamp = ++drm->fb_cache_stamp;
+		}
+	}
+
+	pthread_mutex_unlock(&drm->fb_cache_mutex);
+
+	return err;
 }
 
 /*
- * Remove a fb object for a bo.
+ * Remove a fb object for a bo.  A cached fb is kept for the next bo of its
+ * name, until evicted.
  */
 void gralloc_drm_bo_rm_fb(struct gralloc_drm_bo_t *bo)
 {
-	if (bo->fb_id) {
-		drmModeRmFB(bo->drm->fd, bo->fb_id);
-		bo->fb_id = 0;
+	struct gralloc_drm_t *drm = bo->drm;
+	int i, cached = 0;
+
+	if (!bo->fb_id)
+		return;
+
+	pthread_mutex_lock(&drm->fb_cache_mutex);
+
+	for (i = 0; i < GRALLOC_DRM_FB_CACHE_SIZE; i++) {
+		struct gralloc_drm_fb_t *fb = &drm->fb_cache[i];
+
+		if (fb->fb_id == (uint32_t) bo->fb_id) {
+			fb->users--;
+			cached = 1;
+			break;
+		}
+	}
+	if (!cached)
+		drmModeRmFB(drm->fd, bo->fb_id);
+
+	pthread_mutex_unlock(&drm->fb_cache_mutex);
+
+	bo->fb_id = 0;
+}
+
+/*
+ * Remove the cached fb objects that no bo uses.
+ */
+static void drm_kms_fb_cache_flush(struct gralloc_drm_t *drm)
+{
+	int i;
+
+	pthread_mutex_lock(&drm->fb_cache_mutex);
+	for (i = 0; i < GRALLOC_DRM_FB_CACHE_SIZE; i++) {
+		struct gralloc_drm_fb_t *fb = &drm->fb_cache[i];
+
+		if (fb->fb_id && !fb->users)
+			drm_kms_fb_cache_evict(drm, fb);
 	}
+	pthread_mutex_unlock(&drm->fb_cache_mutex);
 }
 
 /*
@@ -170,518 +325,3870 @@ static int drm_kms_set_crtc(struct gralloc_drm_t *drm,
 	return ret;
 }
 
+#define NSEC_PER_SEC 1000000000LL
+
+/* samples needed before outliers are rejected */
+#define VSYNC_MIN_SAMPLES 6
+/* outliers in a row that mean the timing has changed */
+#define VSYNC_MAX_OUTLIERS 4
+/* the model is resynchronized when its reference is older than this */
+#define VSYNC_RESYNC_NS NSEC_PER_SEC
+
+static int64_t drm_kms_now(const struct gralloc_drm_t *drm)
+{
+	struct timespec ts;
+
+	clock_gettime(drm->vsync_clock, &ts);
+
+	return (int64_t) ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
 /*
- * Callback for a page flip event.
+ * Reset the vsync model of an output to the nominal timing of its mode.
  */
-static void page_flip_handler(int fd, unsigned int sequence,
-		unsigned int tv_sec, unsigned int tv_usec,
-		void *user_data)
+static void drm_kms_vsync_reset(struct gralloc_drm_vsync_t *vsync,
+		const drmModeModeInfo *mode)
 {
-	struct gralloc_drm_t *drm = (struct gralloc_drm_t *) user_data;
+	memset(vsync, 0, sizeof(*vsync));
 
-	/* ack the last scheduled flip */
-	drm->current_front = drm->next_front;
-	drm->next_front = NULL;
+	if (mode->clock && mode->htotal && mode->vtotal)
+		vsync->period = (int64_t) mode->htotal * mode->vtotal *
+			1000000 / mode->clock;
+	else if (mode->vrefresh)
+		vsync->period = NSEC_PER_SEC / mode->vrefresh;
+	else
+		vsync->period = NSEC_PER_SEC / 60;
 }
 
 /*
- * Set a plane.
+ * Feed a vblank timestamp to the vsync model of an output.  The period and
+ * the phase are pulled towards the measurement like a PLL; samples far off
+ * the prediction are rejected unless they keep coming.  The caller must hold
+ * vsync_mutex.
  */
-static int gralloc_drm_bo_setplane(struct gralloc_drm_t *drm,
-	struct gralloc_drm_plane_t *plane)
+static void drm_kms_vsync_sample(struct gralloc_drm_output *output,
+		unsigned int sequence, unsigned int tv_sec, unsigned int tv_usec)
 {
-	struct gralloc_drm_bo_t *bo = NULL;
-	int err;
+	struct gralloc_drm_vsync_t *vsync = &output->vsync;
+	int64_t timestamp, predicted, error;
+	int delta;
 
-	if (plane->handle)
-		bo = gralloc_drm_bo_from_handle(plane->handle);
+	timestamp = (int64_t) tv_sec * NSEC_PER_SEC + (int64_t) tv_usec * 1000;
+	delta = (int) (sequence - vsync->seq);
 
-	// create a framebuffer if does not exist
-	if (bo && bo->fb_id == 0) {
-		err = gralloc_drm_bo_add_fb(bo);
-		if (err) {
-			ALOGE("%s: could not create drm fb, (%s)",
-				__func__, strerror(-err));
-			return err;
-		}
+	if (vsync->samples && (delta <= 0 || timestamp <= vsync->phase))
+		return;
+
+	if (!vsync->samples) {
+		vsync->phase = timestamp;
+		vsync->seq = sequence;
+		vsync->samples = 1;
+		return;
 	}
 
-	err = drmModeSetPlane(drm->fd,
-		plane->drm_plane->plane_id,
-		drm->primary.crtc_id,
-		bo ? bo->fb_id : 0,
-		0, // flags
-		plane->dst_x,
-		plane->dst_y,
-		plane->dst_w,
-		plane->dst_h,
-		plane->src_x << 16,
-		plane->src_y << 16,
-		plane->src_w << 16,
-		plane->src_h << 16);
+	predicted = vsync->phase + delta * vsync->period;
+	error = timestamp - predicted;
 
-	if (err) {
-		/* clear plane_mask so that this buffer won't be tried again */
-		struct gralloc_drm_handle_t *drm_handle =
-			(struct gralloc_drm_handle_t *) plane->handle;
-		drm_handle->plane_mask = 0;
+	if (vsync->samples >= VSYNC_MIN_SAMPLES &&
+	    llabs(error) > vsync->period / 4) {
+		if (++vsync->outliers < VSYNC_MAX_OUTLIERS)
+			return;
 
-		ALOGE("drmModeSetPlane : error (%s) (plane %d crtc %d fb %d)",
-			strerror(-err),
-			plane->drm_plane->plane_id,
-			drm->primary.crtc_id,
-			bo ? bo->fb_id : 0);
+		/* the timing has changed, start over from this sample */
+		ALOGD("vsync model of crtc %d lost lock", output->crtc_id);
+		vsync->phase = timestamp;
+		vsync->seq = sequence;
+		vsync->samples = 1;
+		vsync->outliers = 0;
+		return;
 	}
 
-	if (plane->prev)
-		gralloc_drm_bo_decref(plane->prev);
+	vsync->outliers = 0;
 
-	if (bo)
-		bo->refcount++;
+	/* lock quickly while there are few samples */
+	if (vsync->samples < VSYNC_MIN_SAMPLES) {
+		vsync->period += (timestamp - vsync->phase) / delta - vsync->period;
+		vsync->phase = timestamp;
+	}
+	else {
+		vsync->period += ((timestamp - vsync->phase) / delta -
+				vsync->period) / 8;
+		predicted = vsync->phase + delta * vsync->period;
+		vsync->phase = predicted + (timestamp - predicted) / 4;
+	}
+	vsync->seq = sequence;
+	vsync->samples++;
+}
 
-	plane->prev = bo;
+/*
+ * Return the vblank request type bits of the pipe of an output.
+ */
+static unsigned int drm_kms_vblank_pipe(const struct gralloc_drm_output *output)
+{
+	if (output->pipe == 0)
+		return 0;
+	if (output->pipe == 1)
+		return DRM_VBLANK_SECONDARY;
 
-	return err;
+	return (output->pipe << DRM_VBLANK_HIGH_CRTC_SHIFT) &
+		DRM_VBLANK_HIGH_CRTC_MASK;
 }
 
 /*
- * Returns if a particular plane is supported with the implementation
+ * Sample the current vblank of an output if the model is stale, which
+ * happens when nothing is posted.  The caller must hold vsync_mutex.
  */
-static unsigned is_plane_supported(const struct gralloc_drm_t *drm,
-	const struct gralloc_drm_plane_t *plane)
+static void drm_kms_vsync_resync(struct gralloc_drm_t *drm,
+		struct gralloc_drm_output *output, int64_t now)
+{
+	drmVBlank vbl;
+
+	if (output->vsync.samples && now - output->vsync.phase < VSYNC_RESYNC_NS)
+		return;
+
+	memset(&vbl, 0, sizeof(vbl));
+	vbl.request.type = DRM_VBLANK_RELATIVE | drm_kms_vblank_pipe(output);
+	vbl.request.sequence = 0;
+
+	if (!drmWaitVBlank(drm->fd, &vbl))
+		drm_kms_vsync_sample(output, vbl.reply.sequence,
+				vbl.reply.tval_sec, vbl.reply.tval_usec);
+}
+
+/*
+ * Predict the first vblank at or after a time.  The caller must hold
+ * vsync_mutex.
+ */
+static int64_t drm_kms_vsync_predict(const struct gralloc_drm_vsync_t *vsync,
+		int64_t time)
 {
-	/* Planes are only supported on primary pipe for now */
-	return plane->drm_plane->possible_crtcs & (1 << drm->primary.pipe);
+	if (time <= vsync->phase)
+		return vsync->phase -
+			(vsync->phase - time) / vsync->period * vsync->period;
+
+	return vsync->phase +
+		((time - vsync->phase + vsync->period - 1) / vsync->period) *
+		vsync->period;
 }
 
 /*
- * Sets all the active planes to be displayed.
+ * Return the output of a HWC display.
  */
-static void gralloc_drm_set_planes(struct gralloc_drm_t *drm)
+static struct gralloc_drm_output *drm_kms_get_output(struct gralloc_drm_t *drm,
+		int disp)
 {
-	struct gralloc_drm_plane_t *plane = drm->planes;
-	unsigned int i;
-	for (i = 0; i < drm->plane_resources->count_planes;
-		i++, plane++) {
-		/* plane is not in use at all */
-		if (!plane->active && !plane->handle)
-			continue;
+	if (disp < 0 || disp >= drm->output_count)
+		return NULL;
 
-		/* plane is active, safety check if it is supported */
-		if (!is_plane_supported(drm, plane))
-			ALOGE("%s: plane %d is not supported",
-				 __func__, plane->drm_plane->plane_id);
+	/* the primary is always there */
+	if (disp && !drm->outputs[disp].active)
+		return NULL;
 
-		/*
-		 * Disable overlay if it is not active
-		 * or if there is error during setplane
-		 */
-		if (!plane->active)
-			plane->handle = 0;
+	return &drm->outputs[disp];
+}
 
-		if (gralloc_drm_bo_setplane(drm, plane))
-			plane->active = 0;
-	}
+/*
+ * Return true if an output is posted to through its own swapchain, rather
+ * than showing the primary.
+ */
+static int drm_kms_output_extended(struct gralloc_drm_t *drm,
+		const struct gralloc_drm_output *output)
+{
+	return (output != drm->primary &&
+		(output != drm->hdmi || drm->hdmi_mode == HDMI_EXTENDED));
 }
 
 /*
- * Interface for HWC, used to reserve a plane for a layer.
+ * Thread that calls the vsync callbacks at their offsets from the
+ * predicted vblanks.
  */
-int gralloc_drm_reserve_plane(struct gralloc_drm_t *drm,
-	buffer_handle_t handle,
-	uint32_t id,
-	uint32_t dst_x,
-	uint32_t dst_y,
-	uint32_t dst_w,
-	uint32_t dst_h,
-	uint32_t src_x,
-	uint32_t src_y,
-	uint32_t src_w,
-	uint32_t src_h)
+static void *drm_kms_vsync_loop(void *data)
 {
-	unsigned int i, j;
-	struct gralloc_drm_handle_t *drm_handle =
-		gralloc_drm_handle(handle);
-	int plane_count = drm->plane_resources->count_planes;
-	struct gralloc_drm_plane_t *plane = drm->planes;
+	struct gralloc_drm_t *drm = (struct gralloc_drm_t *) data;
+
+	pthread_mutex_lock(&drm->vsync_mutex);
+	while (!drm->vsync_quit) {
+		struct gralloc_drm_output *output = NULL;
+		void (*callback)(void *data, int disp, int64_t timestamp);
+		void *callback_data;
+		int64_t now, vblank = 0, wakeup = INT64_MAX;
+		struct timespec ts;
+		int disp;
+
+		/* find the earliest callback */
+		now = drm_kms_now(drm);
+		for (disp = 0; disp < drm->output_count; disp++) {
+			struct gralloc_drm_output *o = drm_kms_get_output(drm, disp);
+			int64_t from, t;
+
+			if (!o || !o->vsync_callback)
+				continue;
+
+			drm_kms_vsync_resync(drm, o, now);
+
+			/* do not call back twice for a vblank */
+			from = now - o->vsync_offset;
+			if (from < o->vsync_last + o->vsync.period / 2)
+				from = o->vsync_last + o->vsync.period / 2;
+
+			t = drm_kms_vsync_predict(&o->vsync, from);
+			if (t + o->vsync_offset < wakeup) {
+				output = o;
+				vblank = t;
+				wakeup = t + o->vsync_offset;
+			}
+		}
 
-	/* no supported planes for this handle */
-	if (!drm_handle->plane_mask) {
-		ALOGE("%s: buffer %p cannot be shown on a plane\n",
-			__func__, drm_handle);
-		return -EINVAL;
-	}
+		if (!output) {
+			pthread_cond_wait(&drm->vsync_cond, &drm->vsync_mutex);
+			continue;
+		}
 
-	for (j = 0; j < plane_count; j++, plane++) {
+		pthread_mutex_unlock(&drm->vsync_mutex);
+		if (wakeup > now) {
+			ts.tv_sec = (wakeup - now) / NSEC_PER_SEC;
+			ts.tv_nsec = (wakeup - now) % NSEC_PER_SEC;
+			while (nanosleep(&ts, &ts) && errno == EINTR)
+				;
+		}
+		pthread_mutex_lock(&drm->vsync_mutex);
 
-		/*
-		 * handle may be suitable to be shown on a plane, in
-		 * addition we need to check that this particular plane
-		 * is supported by the current implementation
-		 */
-		if (!is_plane_supported(drm, plane))
+		/* the callback may have been changed while sleeping */
+		callback = output->vsync_callback;
+		if (drm->vsync_quit || !callback)
 			continue;
 
-		/* if plane is available and can support this buffer */
-		if (!plane->active &&
-			drm_handle->plane_mask &
-			(1U << plane->drm_plane->plane_id)) {
-
-			plane->dst_x = dst_x;
-			plane->dst_y = dst_y;
-			plane->dst_w = dst_w;
-			plane->dst_h = dst_h;
-			plane->src_x = src_x;
-			plane->src_y = src_y;
-			plane->src_w = src_w;
-			plane->src_h = src_h;
-			plane->handle = handle;
-			plane->id = id;
-			plane->active = 1;
+		output->vsync_last = vblank;
+		callback_data = output->vsync_data;
+		disp = output - drm->outputs;
 
-			return 0;
-		}
+		pthread_mutex_unlock(&drm->vsync_mutex);
+		callback(callback_data, disp, vblank);
+		pthread_mutex_lock(&drm->vsync_mutex);
 	}
+	pthread_mutex_unlock(&drm->vsync_mutex);
 
-	/* no free planes available */
-	return -EBUSY;
+	return NULL;
 }
 
 /*
- * Interface for HWC, used to disable all the overlays. Plane id
- * is also set to 0 as it should be mappable to a particular layer only
- * if it has been reserved with 'reserve_plane'.
+ * Interface for HWC, used to get the predicted time of the next vblank of
+ * a display.
  */
-void gralloc_drm_disable_planes(struct gralloc_drm_t *drm)
+int gralloc_drm_get_next_vblank(struct gralloc_drm_t *drm,
+		int disp, int64_t *timestamp)
 {
-	struct gralloc_drm_plane_t *plane = drm->planes;
-	unsigned int i;
+	struct gralloc_drm_output *output;
+	int64_t now;
 
-	for (i = 0; i < drm->plane_resources->count_planes; i++, plane++) {
-		plane->active = 0;
-		plane->id = 0;
+	if (!drm->resources)
+		return -EINVAL;
+
+	pthread_mutex_lock(&drm->vsync_mutex);
+
+	output = drm_kms_get_output(drm, disp);
+	if (!output) {
+		pthread_mutex_unlock(&drm->vsync_mutex);
+		return -EINVAL;
 	}
-}
 
-/*
- * Interface for HWC, used to change handle of a reserved plane.
- */
-int gralloc_drm_set_plane_handle(struct gralloc_drm_t *drm,
-	uint32_t id, buffer_handle_t handle)
-{
-	struct gralloc_drm_plane_t *plane = drm->planes;
-	unsigned i;
+	now = drm_kms_now(drm);
+	drm_kms_vsync_resync(drm, output, now);
+	*timestamp = drm_kms_vsync_predict(&output->vsync, now);
 
-	for (i = 0; i < drm->plane_resources->count_planes; i++, plane++)
-		if (plane->active && plane->id == id) {
-			plane->handle = handle;
-			return 0;
-		}
+	pthread_mutex_unlock(&drm->vsync_mutex);
 
-	return -EINVAL;
+	return 0;
 }
 
 /*
- * Schedule a page flip.
+ * Interface for HWC, used to be called back at an offset from every vblank
+ * of a display.  The offset may be negative to be woken up ahead of the
+ * vblank.  A NULL callback stops the callbacks.
  */
-static int drm_kms_page_flip(struct gralloc_drm_t *drm,
-		struct gralloc_drm_bo_t *bo)
+int gralloc_drm_set_vsync_callback(struct gralloc_drm_t *drm,
+		int disp, int64_t offset,
+		void (*callback)(void *data, int disp, int64_t timestamp),
+		void *data)
 {
-	int ret;
+	struct gralloc_drm_output *output;
+	int err = 0;
 
-	/* there is another flip pending */
-	while (drm->next_front) {
-		drm->waiting_flip = 1;
-		drmHandleEvent(drm->fd, &drm->evctx);
-		drm->waiting_flip = 0;
-		if (drm->next_front) {
-			/* record an error and break */
-			ALOGE("drmHandleEvent returned without flipping");
-			drm->current_front = drm->next_front;
-			drm->next_front = NULL;
-		}
-	}
+	if (!drm->resources)
+		return -EINVAL;
 
-	if (!bo)
-		return 0;
+	pthread_mutex_lock(&drm->vsync_mutex);
 
-	pthread_mutex_lock(&drm->hdmi_mutex);
-	if (drm->hdmi.active && drm->hdmi_mode == HDMI_CLONED && drm->hdmi.bo) {
+	output = drm_kms_get_output(drm, disp);
+	if (!output) {
+		pthread_mutex_unlock(&drm->vsync_mutex);
+		return -EINVAL;
+	}
 
-		int dst_x1 = 0, dst_y1 = 0;
+	output->vsync_callback = callback;
+	output->vsync_data = data;
+	output->vsync_offset = offset;
+
+	if (callback && !drm->vsync_thread_started) {
+		drm->vsync_quit = 0;
+		if (pthread_create(&drm->vsync_thread, NULL,
+					drm_kms_vsync_loop, drm)) {
+			ALOGE("failed to create vsync thread");
+			output->vsync_callback = NULL;
+			err = -ENOMEM;
+		}
+		else {
+			drm->vsync_thread_started = 1;
+		}
+	}
+	pthread_cond_signal(&drm->vsync_cond);
 
-		if (drm->hdmi.bo->handle->width > bo->handle->width)
-			dst_x1 = (drm->hdmi.bo->handle->width - bo->handle->width) / 2;
-		if (drm->hdmi.bo->handle->height > bo->handle->height)
-			dst_y1 = (drm->hdmi.bo->handle->height - bo->handle->height) / 2;
+	pthread_mutex_unlock(&drm->vsync_mutex);
 
-		drm->drv->blit(drm->drv, drm->hdmi.bo, bo,
-			dst_x1, dst_y1,
-			dst_x1 + bo->handle->width,
-			dst_y1 + bo->handle->height,
-			0, 0, bo->handle->width, bo->handle->height);
+	return err;
+}
 
-		ret = drmModePageFlip(drm->fd, drm->hdmi.crtc_id, drm->hdmi.bo->fb_id, 0, NULL);
-		if (ret && errno != EBUSY)
-			ALOGE("failed to perform page flip for hdmi (%s) (crtc %d fb %d))",
-				strerror(errno), drm->hdmi.crtc_id, drm->hdmi.bo->fb_id);
+/*
+ * Callback for a page flip event.
+ */
+static void page_flip_handler(int fd, unsigned int sequence,
+		unsigned int tv_sec, unsigned int tv_usec,
+		void *user_data)
+{
+	struct gralloc_drm_output *output =
+		(struct gralloc_drm_output *) user_data;
+	struct gralloc_drm_t *drm = output->drm;
+
+	/* with variable refresh, flips land when frames are ready */
+	if (!output->vrr) {
+		pthread_mutex_lock(&drm->vsync_mutex);
+		drm_kms_vsync_sample(output, sequence, tv_sec, tv_usec);
+		pthread_mutex_unlock(&drm->vsync_mutex);
 	}
-	pthread_mutex_unlock(&drm->hdmi_mutex);
 
-	/* set planes to be displayed */
-	gralloc_drm_set_planes(drm);
+	/* an extended output has its own swapchain */
+	if (drm_kms_output_extended(drm, output)) {
+		output->current_front = output->next_front;
+		output->next_front = NULL;
 
-	ret = drmModePageFlip(drm->fd, drm->primary.crtc_id, bo->fb_id,
-			DRM_MODE_PAGE_FLIP_EVENT, (void *) drm);
-	if (ret) {
-		ALOGE("failed to perform page flip for primary (%s) (crtc %d fb %d))",
-			strerror(errno), drm->primary.crtc_id, bo->fb_id);
-		/* try to set mode for next frame */
+		if (drm->event_callbacks.flip)
+			drm->event_callbacks.flip(drm->event_data,
+				output - drm->outputs, sequence,
+				(int64_t) tv_sec * NSEC_PER_SEC + (int64_t) tv_usec * 1000);
+		return;
+	}
+
+	/* the clone has landed, wake up the worker */
+	if (output != drm->primary) {
+		pthread_mutex_lock(&drm->clone_mutex);
+		output->flip_pending = 0;
+		if (drm->clone_flipping) {
+			drm->clone_shown = drm->clone_flipping;
+			drm->clone_flipping = NULL;
+		}
+		pthread_cond_signal(&drm->clone_cond);
+		pthread_mutex_unlock(&drm->clone_mutex);
+
+		/* a shared primary bo is scanned out, hdmi is off the last one */
+		if (drm->clone_pending) {
+			if (drm->clone_front)
+				gralloc_drm_bo_decref(drm->clone_front);
+			drm->clone_front = drm->clone_pending;
+			drm->clone_pending = NULL;
+		}
+		return;
+	}
+
+	/* ack the last scheduled flip */
+	drm->current_front = drm->next_front;
+	drm->next_front = NULL;
+	drm->last_swap = sequence;
+
+	if (drm->event_callbacks.flip)
+		drm->event_callbacks.flip(drm->event_data, 0, sequence,
+			(int64_t) tv_sec * NSEC_PER_SEC + (int64_t) tv_usec * 1000);
+}
+
+/*
+ * Returns if a particular plane can be used on a pipe
+ */
+static unsigned is_plane_supported(const struct gralloc_drm_plane_t *plane,
+	uint32_t pipe)
+{
+	return plane->drm_plane->possible_crtcs & (1 << pipe);
+}
+
+static const char *drm_kms_plane_prop_names[GRALLOC_DRM_PLANE_PROP_COUNT] = {
+	"FB_ID", "CRTC_ID",
+	"SRC_X", "SRC_Y", "SRC_W", "SRC_H",
+	"CRTC_X", "CRTC_Y", "CRTC_W", "CRTC_H",
+};
+
+/*
+ * Read the properties of a plane: its type, zpos, rotations and the ids
+ * of the properties used for atomic tests.
+ */
+static void drm_kms_probe_plane(struct gralloc_drm_t *drm,
+	struct gralloc_drm_plane_t *plane)
+{
+	drmModeObjectPropertiesPtr props;
+	uint32_t i;
+	int j;
+
+	plane->zpos = -1;
+	plane->overlay = 1;
+	plane->rotations = 0;
+	memset(plane->prop_ids, 0, sizeof(plane->prop_ids));
+
+	props = drmModeObjectGetProperties(drm->fd,
+			plane->drm_plane->plane_id, DRM_MODE_OBJECT_PLANE);
+	if (!props)
+		return;
+
+	for (i = 0; i < props->count_props; i++) {
+		drmModePropertyPtr prop = drmModeGetProperty(drm->fd,
+				props->props[i]);
+
+		if (!prop)
+			continue;
+
+		if (!strcmp(prop->name, "zpos")) {
+			plane->zpos = (int) props->prop_values[i];
+		}
+		else if (!strcmp(prop->name, "type")) {
+			/* DRM_PLANE_TYPE_OVERLAY */
+			plane->overlay = (props->prop_values[i] == 0);
+		}
+		else if (!strcmp(prop->name, "rotation")) {
+			for (j = 0; j < prop->count_enums; j++)
+				plane->rotations |= 1ULL << prop->enums[j].value;
+		}
+		else {
+			for (j = 0; j < GRALLOC_DRM_PLANE_PROP_COUNT; j++) {
+				if (!strcmp(prop->name,
+					drm_kms_plane_prop_names[j])) {
+					plane->prop_ids[j] = prop->prop_id;
+					break;
+				}
+			}
+		}
+
+		drmModeFreeProperty(prop);
+	}
+
+	drmModeFreeObjectProperties(props);
+}
+
+/*
+ * Describe a layer on a plane.
+ */
+static void drm_kms_plane_config(struct gralloc_drm_plane_config_t *config,
+	const struct gralloc_drm_plane_t *plane, uint32_t crtc_id,
+	const struct gralloc_drm_handle_t *handle,
+	uint32_t dst_x, uint32_t dst_y, uint32_t dst_w, uint32_t dst_h,
+	uint32_t src_x, uint32_t src_y, uint32_t src_w, uint32_t src_h)
+{
+	config->plane_id = plane->drm_plane->plane_id;
+	config->crtc_id = crtc_id;
+	config->format = drm_format_from_hal(handle->format);
+	config->width = handle->width;
+	config->height = handle->height;
+	config->src_x = src_x;
+	config->src_y = src_y;
+	config->src_w = src_w;
+	config->src_h = src_h;
+	config->dst_x = dst_x;
+	config->dst_y = dst_y;
+	config->dst_w = dst_w;
+	config->dst_h = dst_h;
+}
+
+static uint32_t drm_kms_plane_config_hash(
+	const struct gralloc_drm_plane_config_t *config)
+{
+	const unsigned char *p = (const unsigned char *) config;
+	uint32_t hash = 2166136261u;
+	size_t i;
+
+	/* FNV-1a */
+	for (i = 0; i < sizeof(*config); i++) {
+		hash ^= p[i];
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+/*
+ * Look up the cached result of a plane configuration.  Return 1 and set
+ * result if there is one.
+ */
+static int drm_kms_plane_check_lookup(struct gralloc_drm_t *drm,
+	const struct gralloc_drm_plane_config_t *config, int *result)
+{
+	uint32_t hash = drm_kms_plane_config_hash(config);
+	struct gralloc_drm_plane_check_t *check =
+		&drm->plane_checks[hash % GRALLOC_DRM_PLANE_CHECK_CACHE_SIZE];
+	int found;
+
+	pthread_mutex_lock(&drm->plane_check_mutex);
+	found = (check->valid && check->hash == hash &&
+		!memcmp(&check->config, config, sizeof(*config)));
+	if (found)
+		*result = check->result;
+	pthread_mutex_unlock(&drm->plane_check_mutex);
+
+	return found;
+}
+
+/*
+ * Cache the result of a plane configuration, replacing whatever shared
+ * its slot.
+ */
+static void drm_kms_plane_check_record(struct gralloc_drm_t *drm,
+	const struct gralloc_drm_plane_config_t *config, int result)
+{
+	uint32_t hash = drm_kms_plane_config_hash(config);
+	struct gralloc_drm_plane_check_t *check =
+		&drm->plane_checks[hash % GRALLOC_DRM_PLANE_CHECK_CACHE_SIZE];
+
+	pthread_mutex_lock(&drm->plane_check_mutex);
+	check->config = *config;
+	check->hash = hash;
+	check->result = result;
+	check->valid = 1;
+	pthread_mutex_unlock(&drm->plane_check_mutex);
+}
+
+/*
+ * Forget all cached results, when a mode changes.
+ */
+static void drm_kms_plane_check_flush(struct gralloc_drm_t *drm)
+{
+	pthread_mutex_lock(&drm->plane_check_mutex);
+	memset(drm->plane_checks, 0, sizeof(drm->plane_checks));
+	pthread_mutex_unlock(&drm->plane_check_mutex);
+}
+
+/*
+ * Check a plane configuration against what is known of the plane.
+ */
+static int drm_kms_plane_check_sw(const struct gralloc_drm_t *drm,
+	const struct gralloc_drm_plane_t *plane,
+	const struct gralloc_drm_output *output,
+	const struct gralloc_drm_handle_t *handle,
+	const struct gralloc_drm_plane_config_t *config)
+{
+	if (!plane->overlay || plane->reserved ||
+	    !is_plane_supported(plane, output->pipe))
+		return -EINVAL;
+
+	if (!config->format ||
+	    !(handle->plane_mask & drm_kms_plane_bit(drm, plane)))
+		return -EINVAL;
+
+	if (!config->src_w || !config->src_h ||
+	    !config->dst_w || !config->dst_h)
+		return -EINVAL;
+
+	if (config->src_x + config->src_w > config->width ||
+	    config->src_y + config->src_h > config->height)
+		return -EINVAL;
+
+	if (plane->no_scaling && (config->src_w != config->dst_w ||
+				  config->src_h != config->dst_h))
+		return -EINVAL;
+
+	return 0;
+}
+
+#if defined(DRM_CLIENT_CAP_ATOMIC) && defined(DRM_MODE_ATOMIC_TEST_ONLY)
+/*
+ * Ask the kernel whether a plane can show a bo.
+ */
+static int drm_kms_plane_check_atomic(struct gralloc_drm_t *drm,
+	const struct gralloc_drm_plane_t *plane, struct gralloc_drm_bo_t *bo,
+	const struct gralloc_drm_plane_config_t *config)
+{
+	const uint32_t *ids = plane->prop_ids;
+	drmModeAtomicReqPtr req;
+	int i, err = 0;
+
+	for (i = 0; i < GRALLOC_DRM_PLANE_PROP_COUNT; i++)
+		if (!ids[i])
+			return -ENOSYS;
+
+	if (!bo->fb_id) {
+		err = gralloc_drm_bo_add_fb(bo);
+		if (err)
+			return err;
+	}
+
+	req = drmModeAtomicAlloc();
+	if (!req)
+		return -ENOMEM;
+
+	drmModeAtomicAddProperty(req, config->plane_id,
+		ids[GRALLOC_DRM_PLANE_PROP_FB_ID], bo->fb_id);
+	drmModeAtomicAddProperty(req, config->plane_id,
+		ids[GRALLOC_DRM_PLANE_PROP_CRTC_ID], config->crtc_id);
+	drmModeAtomicAddProperty(req, config->plane_id,
+		ids[GRALLOC_DRM_PLANE_PROP_SRC_X], config->src_x << 16);
+	drmModeAtomicAddProperty(req, config->plane_id,
+		ids[GRALLOC_DRM_PLANE_PROP_SRC_Y], config->src_y << 16);
+	drmModeAtomicAddProperty(req, config->plane_id,
+		ids[GRALLOC_DRM_PLANE_PROP_SRC_W], config->src_w << 16);
+	drmModeAtomicAddProperty(req, config->plane_id,
+		ids[GRALLOC_DRM_PLANE_PROP_SRC_H], config->src_h << 16);
+	drmModeAtomicAddProperty(req, config->plane_id,
+		ids[GRALLOC_DRM_PLANE_PROP_CRTC_X], config->dst_x);
+	drmModeAtomicAddProperty(req, config->plane_id,
+		ids[GRALLOC_DRM_PLANE_PROP_CRTC_Y], config->dst_y);
+	drmModeAtomicAddProperty(req, config->plane_id,
+		ids[GRALLOC_DRM_PLANE_PROP_CRTC_W], config->dst_w);
+	drmModeAtomicAddProperty(req, config->plane_id,
+		ids[GRALLOC_DRM_PLANE_PROP_CRTC_H], config->dst_h);
+
+	if (drmModeAtomicCommit(drm->fd, req, DRM_MODE_ATOMIC_TEST_ONLY, NULL))
+		err = -errno;
+
+	drmModeAtomicFree(req);
+
+	return err;
+}
+#endif
+
+/*
+ * Validate a layer on a plane of an output, using the cached result when
+ * there is one.
+ */
+static int drm_kms_plane_check(struct gralloc_drm_t *drm,
+	const struct gralloc_drm_plane_t *plane,
+	const struct gralloc_drm_output *output,
+	buffer_handle_t handle,
+	uint32_t dst_x, uint32_t dst_y, uint32_t dst_w, uint32_t dst_h,
+	uint32_t src_x, uint32_t src_y, uint32_t src_w, uint32_t src_h)
+{
+	struct gralloc_drm_handle_t *drm_handle = gralloc_drm_handle(handle);
+	struct gralloc_drm_plane_config_t config;
+	int err;
+
+	if (!drm_handle)
+		return -EINVAL;
+
+	drm_kms_plane_config(&config, plane, output->crtc_id, drm_handle,
+		dst_x, dst_y, dst_w, dst_h, src_x, src_y, src_w, src_h);
+
+	if (drm_kms_plane_check_lookup(drm, &config, &err))
+		return err;
+
+	err = drm_kms_plane_check_sw(drm, plane, output, drm_handle, &config);
+
+#if defined(DRM_CLIENT_CAP_ATOMIC) && defined(DRM_MODE_ATOMIC_TEST_ONLY)
+	if (!err && drm->atomic) {
+		struct gralloc_drm_bo_t *bo = gralloc_drm_bo_from_handle(handle);
+
+		if (bo) {
+			err = drm_kms_plane_check_atomic(drm, plane, bo, &config);
+			/* not testable, trust the software checks */
+			if (err == -ENOSYS)
+				err = 0;
+		}
+	}
+#endif
+
+	drm_kms_plane_check_record(drm, &config, err);
+
+	return err;
+}
+
+/*
+ * Compute the state to program a plane with to show bo, and return true if
+ * it differs from what the plane shows.
+ */
+static int drm_kms_plane_changed(const struct gralloc_drm_t *drm,
+	const struct gralloc_drm_plane_t *plane,
+	const struct gralloc_drm_bo_t *bo,
+	struct gralloc_drm_plane_state_t *state)
+{
+	memset(state, 0, sizeof(*state));
+	state->crtc_id = plane->crtc_id;
+	state->fb_id = (bo) ? bo->fb_id : 0;
+	if (bo) {
+		state->src_x = plane->src_x;
+		state->src_y = plane->src_y;
+		state->src_w = plane->src_w;
+		state->src_h = plane->src_h;
+		state->dst_x = plane->dst_x;
+		state->dst_y = plane->dst_y;
+		state->dst_w = plane->dst_w;
+		state->dst_h = plane->dst_h;
+	}
+
+	return (!plane->committed || plane->prev != bo ||
+		memcmp(&plane->state, state, sizeof(*state)));
+}
+
+/*
+ * Set a plane.
+ */
+static int gralloc_drm_bo_setplane(struct gralloc_drm_t *drm,
+	struct gralloc_drm_plane_t *plane)
+{
+	struct gralloc_drm_bo_t *bo = NULL;
+	struct gralloc_drm_plane_state_t state;
+	int err;
+
+	if (plane->handle)
+		bo = gralloc_drm_bo_from_handle(plane->handle);
+
+	// create a framebuffer if does not exist
+	if (bo && bo->fb_id == 0) {
+		err = gralloc_drm_bo_add_fb(bo);
+		if (err) {
+			ALOGE("%s: could not create drm fb, (%s)",
+				__func__, strerror(-err));
+			return err;
+		}
+	}
+
+	/* the plane already shows this, and holds a reference to bo */
+	if (!drm_kms_plane_changed(drm, plane, bo, &state))
+		return 0;
+
+	err = drmModeSetPlane(drm->fd,
+		plane->drm_plane->plane_id,
+		state.crtc_id,
+		state.fb_id,
+		0, // flags
+		state.dst_x,
+		state.dst_y,
+		state.dst_w,
+		state.dst_h,
+		state.src_x << 16,
+		state.src_y << 16,
+		state.src_w << 16,
+		state.src_h << 16);
+
+	plane->committed = !err;
+	plane->state = state;
+
+	if (bo) {
+		struct gralloc_drm_plane_config_t config;
+
+		/* so that the configuration is not tried again if it failed */
+		drm_kms_plane_config(&config, plane, state.crtc_id, bo->handle,
+			state.dst_x, state.dst_y, state.dst_w, state.dst_h,
+			state.src_x, state.src_y, state.src_w, state.src_h);
+		drm_kms_plane_check_record(drm, &config, err);
+	}
+
+	if (err) {
+		/*
+		 * when scaling, blame the plane so that the allocator stops
+		 * giving it scaled layers at all
+		 */
+		if (state.src_w != state.dst_w || state.src_h != state.dst_h)
+			plane->no_scaling = 1;
+
+		ALOGE("drmModeSetPlane : error (%s) (plane %d crtc %d fb %d)",
+			strerror(-err),
+			plane->drm_plane->plane_id,
+			plane->crtc_id,
+			bo ? bo->fb_id : 0);
+	}
+
+	if (plane->prev)
+		gralloc_drm_bo_decref(plane->prev);
+
+	if (bo)
+		gralloc_drm_bo_incref(bo);
+
+	plane->prev = bo;
+
+	return err;
+}
+
+/*
+ * Sets the active planes of an output to be displayed, on its post.
+ */
+static void gralloc_drm_set_planes(struct gralloc_drm_t *drm,
+		const struct gralloc_drm_output *output)
+{
+	struct gralloc_drm_plane_t *plane = drm->planes;
+	unsigned int i;
+
+	if (!plane)
+		return;
+
+	for (i = 0; i < drm->plane_resources->count_planes;
+		i++, plane++) {
+		/* plane is not in use at all */
+		if (!plane->active && !plane->handle)
+			continue;
+
+		/* reserved for another output */
+		if (plane->crtc_id != output->crtc_id)
+			continue;
+
+		/* plane is active, safety check if it is supported */
+		if (plane->active && !is_plane_supported(plane, plane->pipe))
+			ALOGE("%s: plane %d is not supported",
+				 __func__, plane->drm_plane->plane_id);
+
+		/*
+		 * Disable overlay if it is not active
+		 * or if there is error during setplane
+		 */
+		if (!plane->active)
+			plane->handle = 0;
+
+		if (gralloc_drm_bo_setplane(drm, plane))
+			plane->active = 0;
+	}
+}
+
+/*
+ * Return true if gralloc_drm_set_planes would program any plane of an
+ * output.
+ */
+static int gralloc_drm_planes_changed(struct gralloc_drm_t *drm,
+		const struct gralloc_drm_output *output)
+{
+	struct gralloc_drm_plane_t *plane = drm->planes;
+	struct gralloc_drm_plane_state_t state;
+	unsigned int i;
+
+	if (!plane)
+		return 0;
+
+	for (i = 0; i < drm->plane_resources->count_planes;
+		i++, plane++) {
+		struct gralloc_drm_bo_t *bo = NULL;
+
+		if (!plane->active && !plane->handle)
+			continue;
+		if (plane->crtc_id != output->crtc_id)
+			continue;
+
+		/* to be disabled */
+		if (!plane->active)
+			return 1;
+
+		if (plane->handle)
+			bo = gralloc_drm_bo_from_handle(plane->handle);
+		if (bo && !bo->fb_id)
+			return 1;
+
+		if (drm_kms_plane_changed(drm, plane, bo, &state))
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Return the number of bytes a plane fetches per frame to show a layer.
+ */
+static uint64_t drm_kms_plane_fetch(const struct gralloc_drm_handle_t *handle,
+	uint32_t src_w, uint32_t src_h)
+{
+	int bpp = gralloc_drm_get_bpp(handle->format);
+
+	/* assume the worst for unknown formats */
+	if (!bpp)
+		bpp = 4;
+
+	return (uint64_t) src_w * src_h * bpp;
+}
+
+/*
+ * Map a rectangle HWC gives in the render size of the primary swapchain to
+ * the mode, which the scaler plane stretches the swapchain to.
+ */
+static void drm_kms_scale_dst(const struct gralloc_drm_t *drm,
+	const struct gralloc_drm_output *output,
+	uint32_t *dst_x, uint32_t *dst_y, uint32_t *dst_w, uint32_t *dst_h)
+{
+	uint32_t x2, y2;
+
+	if (output != drm->primary || !drm->scaler ||
+	    !drm->render_width || !drm->render_height)
+		return;
+
+	x2 = (uint64_t) (*dst_x + *dst_w) * output->mode.hdisplay /
+		drm->render_width;
+	y2 = (uint64_t) (*dst_y + *dst_h) * output->mode.vdisplay /
+		drm->render_height;
+	*dst_x = (uint64_t) *dst_x * output->mode.hdisplay / drm->render_width;
+	*dst_y = (uint64_t) *dst_y * output->mode.vdisplay / drm->render_height;
+	*dst_w = x2 - *dst_x;
+	*dst_h = y2 - *dst_y;
+}
+
+/*
+ * Score how well a free plane suits a layer.  Return -1 if the plane
+ * cannot show the layer at all, otherwise the higher the better.
+ *
+ * zpos_floor is the highest zpos reserved so far on the crtc; HWC reserves
+ * layers bottom to top, so a layer must go above it.
+ */
+static int drm_kms_score_plane(const struct gralloc_drm_t *drm,
+	const struct gralloc_drm_plane_t *plane,
+	const struct gralloc_drm_output *output,
+	const struct gralloc_drm_handle_t *handle, uint32_t id,
+	int scaled, int zpos_floor)
+{
+	int score = 1024;
+
+	if (plane->active || !plane->overlay || plane->reserved ||
+	    !is_plane_supported(plane, output->pipe))
+		return -1;
+
+	/* format */
+	if (!(handle->plane_mask & drm_kms_plane_bit(drm, plane)))
+		return -1;
+
+	/* scaling */
+	if (scaled && plane->no_scaling)
+		return -1;
+
+	/* z-order, prefer the lowest plane that keeps the stacking */
+	if (plane->zpos >= 0) {
+		if (plane->zpos <= zpos_floor)
+			return -1;
+		score -= plane->zpos - zpos_floor;
+	}
+
+	/* a plane known to scale is better kept for scaled layers */
+	if (!scaled && !plane->no_scaling)
+		score -= 16;
+
+	/* leave the planes supporting more formats to other layers */
+	score -= plane->drm_plane->count_formats;
+
+	/* keep the plane of the previous frame, which needs no reprogramming */
+	if (id && plane->prev_id == id && plane->crtc_id == output->crtc_id)
+		score += 512;
+
+	return (score > 0) ? score : 0;
+}
+
+/*
+ * Interface for HWC, used to reserve a plane on a display for a layer.
+ */
+int gralloc_drm_reserve_display_plane(struct gralloc_drm_t *drm,
+	int disp,
+	buffer_handle_t handle,
+	uint32_t id,
+	uint32_t dst_x,
+	uint32_t dst_y,
+	uint32_t dst_w,
+	uint32_t dst_h,
+	uint32_t src_x,
+	uint32_t src_y,
+	uint32_t src_w,
+	uint32_t src_h)
+{
+	unsigned int j;
+	struct gralloc_drm_handle_t *drm_handle =
+		gralloc_drm_handle(handle);
+	int plane_count = drm->plane_resources->count_planes;
+	struct gralloc_drm_plane_t *plane = drm->planes;
+	struct gralloc_drm_plane_t *best = NULL;
+	struct gralloc_drm_output *output;
+	uint64_t fetch, bandwidth = 0;
+	int scaled, zpos_floor = -1, best_score = -1;
+
+	/* no supported planes for this handle */
+	if (!drm_handle->plane_mask) {
+		ALOGE("%s: buffer %p cannot be shown on a plane\n",
+			__func__, drm_handle);
+		return -EINVAL;
+	}
+
+	output = drm_kms_get_output(drm, disp);
+	if (!output || !output->active)
+		return -EINVAL;
+
+	drm_kms_scale_dst(drm, output, &dst_x, &dst_y, &dst_w, &dst_h);
+
+	/* layers go above the scaled swapchain */
+	if (output == drm->primary && drm->scaler)
+		zpos_floor = drm->scaler->zpos;
+
+	/* what the planes already reserved on the crtc take */
+	for (j = 0; j < plane_count; j++, plane++) {
+		if (!plane->active || plane->crtc_id != output->crtc_id)
+			continue;
+
+		if (plane->zpos > zpos_floor)
+			zpos_floor = plane->zpos;
+		if (gralloc_drm_handle(plane->handle))
+			bandwidth += drm_kms_plane_fetch(
+					gralloc_drm_handle(plane->handle),
+					plane->src_w, plane->src_h);
+	}
+
+	fetch = drm_kms_plane_fetch(drm_handle, src_w, src_h);
+	if (drm->plane_bandwidth && bandwidth + fetch > drm->plane_bandwidth)
+		return -EBUSY;
+
+	scaled = (src_w != dst_w || src_h != dst_h);
+
+	plane = drm->planes;
+	for (j = 0; j < plane_count; j++, plane++) {
+		struct gralloc_drm_plane_config_t config;
+		int score = drm_kms_score_plane(drm, plane, output, drm_handle,
+				id, scaled, zpos_floor);
+		int err;
+
+		if (score <= best_score)
+			continue;
+
+		/* skip configurations known to fail */
+		drm_kms_plane_config(&config, plane, output->crtc_id,
+			drm_handle, dst_x, dst_y, dst_w, dst_h,
+			src_x, src_y, src_w, src_h);
+		if (drm_kms_plane_check_lookup(drm, &config, &err) && err)
+			continue;
+
+		best = plane;
+		best_score = score;
+	}
+
+	/* no free planes available */
+	if (!best)
+		return -EBUSY;
+
+	best->dst_x = dst_x;
+	best->dst_y = dst_y;
+	best->dst_w = dst_w;
+	best->dst_h = dst_h;
+	best->src_x = src_x;
+	best->src_y = src_y;
+	best->src_w = src_w;
+	best->src_h = src_h;
+	best->handle = handle;
+	best->id = id;
+	best->crtc_id = output->crtc_id;
+	best->pipe = output->pipe;
+	best->active = 1;
+
+	return 0;
+}
+
+/*
+ * Interface for HWC, used to reserve a plane for a layer on the primary
+ * display.
+ */
+int gralloc_drm_reserve_plane(struct gralloc_drm_t *drm,
+	buffer_handle_t handle,
+	uint32_t id,
+	uint32_t dst_x,
+	uint32_t dst_y,
+	uint32_t dst_w,
+	uint32_t dst_h,
+	uint32_t src_x,
+	uint32_t src_y,
+	uint32_t src_w,
+	uint32_t src_h)
+{
+	return gralloc_drm_reserve_display_plane(drm, 0, handle, id,
+			dst_x, dst_y, dst_w, dst_h,
+			src_x, src_y, src_w, src_h);
+}
+
+/*
+ * Interface for HWC, used to disable all the overlays. Plane id
+ * is also set to 0 as it should be mappable to a particular layer only
+ * if it has been reserved with 'reserve_plane'.  The id is remembered so
+ * that the layer gets the same plane back in the next frame.
+ */
+void gralloc_drm_disable_planes(struct gralloc_drm_t *drm)
+{
+	struct gralloc_drm_plane_t *plane = drm->planes;
+	unsigned int i;
+
+	for (i = 0; i < drm->plane_resources->count_planes; i++, plane++) {
+		if (plane->active)
+			plane->prev_id = plane->id;
+		else if (!plane->handle)
+			plane->prev_id = 0;
+		plane->active = 0;
+		plane->id = 0;
+	}
+}
+
+/*
+ * Interface for HWC, used to change handle of a reserved plane.
+ */
+int gralloc_drm_set_plane_handle(struct gralloc_drm_t *drm,
+	uint32_t id, buffer_handle_t handle)
+{
+	struct gralloc_drm_plane_t *plane = drm->planes;
+	unsigned i;
+
+	for (i = 0; i < drm->plane_resources->count_planes; i++, plane++)
+		if (plane->active && plane->id == id) {
+			plane->handle = handle;
+			return 0;
+		}
+
+	return -EINVAL;
+}
+
+/*
+ * Interface for HWC, used to get the number of planes.
+ */
+int gralloc_drm_get_plane_count(struct gralloc_drm_t *drm)
+{
+	return (drm->plane_resources) ? drm->plane_resources->count_planes : 0;
+}
+
+/*
+ * Interface for HWC, used to query what a plane can do.
+ */
+int gralloc_drm_get_plane_caps(struct gralloc_drm_t *drm, int index,
+	struct gralloc_drm_plane_caps_t *caps)
+{
+	struct gralloc_drm_plane_t *plane;
+	int disp;
+
+	if (index < 0 || index >= gralloc_drm_get_plane_count(drm))
+		return -EINVAL;
+
+	plane = &drm->planes[index];
+
+	memset(caps, 0, sizeof(*caps));
+	caps->plane_id = plane->drm_plane->plane_id;
+	caps->formats = plane->drm_plane->formats;
+	caps->count_formats = plane->drm_plane->count_formats;
+	caps->zpos = plane->zpos;
+	caps->scaling = !plane->no_scaling;
+	caps->rotations = plane->rotations;
+
+	/* primary and cursor planes are not handed out, nor reserved ones */
+	if (!plane->overlay || plane->reserved)
+		return 0;
+
+	for (disp = 0; disp < drm->output_count; disp++) {
+		struct gralloc_drm_output *output = drm_kms_get_output(drm, disp);
+
+		if (output && output->active &&
+		    is_plane_supported(plane, output->pipe))
+			caps->displays |= 1 << disp;
+	}
+
+	return 0;
+}
+
+/*
+ * Interface for HWC, used to check up front whether a plane can show a
+ * layer on a display.  Results are cached by configuration, and include
+ * what drmModeSetPlane reported for configurations already shown.
+ */
+int gralloc_drm_validate_plane(struct gralloc_drm_t *drm,
+	int disp, uint32_t plane_id, buffer_handle_t handle,
+	uint32_t dst_x, uint32_t dst_y, uint32_t dst_w, uint32_t dst_h,
+	uint32_t src_x, uint32_t src_y, uint32_t src_w, uint32_t src_h)
+{
+	struct gralloc_drm_output *output = drm_kms_get_output(drm, disp);
+	int i;
+
+	if (!output || !output->active)
+		return -EINVAL;
+
+	drm_kms_scale_dst(drm, output, &dst_x, &dst_y, &dst_w, &dst_h);
+
+	for (i = 0; i < gralloc_drm_get_plane_count(drm); i++) {
+		struct gralloc_drm_plane_t *plane = &drm->planes[i];
+
+		if (plane->drm_plane->plane_id == plane_id)
+			return drm_kms_plane_check(drm, plane, output, handle,
+				dst_x, dst_y, dst_w, dst_h,
+				src_x, src_y, src_w, src_h);
+	}
+
+	return -EINVAL;
+}
+
+/*
+ * Interface for HWC, used to get the size of cursor images.
+ */
+void gralloc_drm_get_cursor_size(struct gralloc_drm_t *drm,
+	uint32_t *width, uint32_t *height)
+{
+	*width = drm->cursor_width;
+	*height = drm->cursor_height;
+}
+
+/*
+ * Return true if a cursor holds a copy of an image.  The comparison stops
+ * at the first row that differs.  The caller has mapped the source.
+ */
+static int drm_kms_cursor_match(const struct gralloc_drm_cursor_t *cursor,
+	const struct gralloc_drm_handle_t *src, const void *addr)
+{
+	const unsigned char *row = (const unsigned char *) addr;
+	const unsigned char *image = cursor->image;
+	int y;
+
+	if (!cursor->bo || !image || cursor->format != src->format ||
+	    cursor->width != src->width || cursor->height != src->height)
+		return 0;
+
+	for (y = 0; y < src->height; y++) {
+		if (memcmp(row, image, src->width * 4))
+			return 0;
+		row += src->stride;
+		image += src->width * 4;
+	}
+
+	return 1;
+}
+
+/*
+ * Return true if a cursor is shown on an output.  The caller must hold
+ * cursor_mutex.
+ */
+static int drm_kms_cursor_shown(struct gralloc_drm_t *drm,
+	const struct gralloc_drm_cursor_t *cursor)
+{
+	int i;
+
+	for (i = 0; i < drm->output_count; i++) {
+		if (drm->outputs[i].cursor == cursor)
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Find the cursor with an image, or copy the image to a cursor-sized bo,
+ * reusing the least recently used cursor that is not shown.  The caller
+ * must hold cursor_mutex and have mapped the source.
+ */
+static struct gralloc_drm_cursor_t *drm_kms_cursor_upload(
+	struct gralloc_drm_t *drm, const struct gralloc_drm_handle_t *src,
+	const void *addr)
+{
+	struct gralloc_drm_cursor_t *cursor, *slot = NULL;
+	const unsigned char *src_row;
+	unsigned char *dst_row;
+	void *dst_addr;
+	int i, x, y, stride;
+
+	for (i = 0; i < GRALLOC_DRM_CURSOR_CACHE_SIZE; i++) {
+		cursor = &drm->cursors[i];
+
+		if (drm_kms_cursor_match(cursor, src, addr)) {
+			cursor->stamp = ++drm->cursor_stamp;
+			return cursor;
+		}
+
+		if (drm_kms_cursor_shown(drm, cursor))
+			continue;
+		if (!slot || !cursor->bo ||
+		    (slot->bo && cursor->stamp < slot->stamp))
+			slot = cursor;
+	}
+
+	if (!slot)
+		return NULL;
+
+	if (!slot->bo) {
+		slot->bo = gralloc_drm_bo_create(drm,
+				drm->cursor_width, drm->cursor_height,
+				HAL_PIXEL_FORMAT_BGRA_8888,
+				GRALLOC_USAGE_SW_WRITE_OFTEN);
+		if (!slot->bo)
+			return NULL;
+	}
+	if (!slot->image) {
+		slot->image = malloc(drm->cursor_width * drm->cursor_height * 4);
+		if (!slot->image)
+			return NULL;
+	}
+
+	/* the slot no longer holds what it held */
+	slot->width = slot->height = 0;
+
+	/* cursors are scanned out without a pitch of their own */
+	gralloc_drm_bo_get_handle(slot->bo, &stride);
+	if (stride != drm->cursor_width * 4) {
+		ALOGE("cursor bo has stride %d, need %d",
+			stride, drm->cursor_width * 4);
+		return NULL;
+	}
+
+	if (gralloc_drm_bo_lock(slot->bo, GRALLOC_USAGE_SW_WRITE_OFTEN,
+			0, 0, drm->cursor_width, drm->cursor_height,
+			&dst_addr))
+		return NULL;
+
+	memset(dst_addr, 0, stride * drm->cursor_height);
+
+	src_row = (const unsigned char *) addr;
+	dst_row = (unsigned char *) dst_addr;
+	for (y = 0; y < src->height; y++) {
+		if (src->format == HAL_PIXEL_FORMAT_BGRA_8888) {
+			memcpy(dst_row, src_row, src->width * 4);
+		}
+		else {
+			/* RGBA to BGRA */
+			for (x = 0; x < src->width * 4; x += 4) {
+				dst_row[x + 0] = src_row[x + 2];
+				dst_row[x + 1] = src_row[x + 1];
+				dst_row[x + 2] = src_row[x + 0];
+				dst_row[x + 3] = src_row[x + 3];
+			}
+		}
+
+		src_row += src->stride;
+		dst_row += stride;
+	}
+
+	gralloc_drm_bo_unlock(slot->bo);
+
+	/* kept to recognize the image, as read from the source */
+	src_row = (const unsigned char *) addr;
+	for (y = 0; y < src->height; y++) {
+		memcpy(slot->image + y * src->width * 4, src_row,
+				src->width * 4);
+		src_row += src->stride;
+	}
+	slot->format = src->format;
+	slot->width = src->width;
+	slot->height = src->height;
+	slot->stamp = ++drm->cursor_stamp;
+
+	return slot;
+}
+
+/*
+ * Interface for HWC, used to show a cursor image on a display, or to hide
+ * the cursor when handle is NULL.  The image must fit in the cursor size
+ * and be in BGRA_8888 or RGBA_8888.  Showing an image shown before needs
+ * no copy.
+ */
+int gralloc_drm_set_cursor(struct gralloc_drm_t *drm, int disp,
+	buffer_handle_t handle, int hot_x, int hot_y)
+{
+	struct gralloc_drm_output *output = drm_kms_get_output(drm, disp);
+	struct gralloc_drm_cursor_t *cursor = NULL;
+	int err = 0;
+
+	if (!output || !output->active)
+		return -EINVAL;
+
+	pthread_mutex_lock(&drm->cursor_mutex);
+
+	if (handle) {
+		struct gralloc_drm_bo_t *bo = gralloc_drm_bo_from_handle(handle);
+		struct gralloc_drm_handle_t *src = (bo) ? bo->handle : NULL;
+		void *addr;
+
+		if (!src || src->width > drm->cursor_width ||
+		    src->height > drm->cursor_height ||
+		    (src->format != HAL_PIXEL_FORMAT_BGRA_8888 &&
+		     src->format != HAL_PIXEL_FORMAT_RGBA_8888)) {
+			err = -EINVAL;
+			goto out;
+		}
+
+		err = gralloc_drm_bo_lock(bo, GRALLOC_USAGE_SW_READ_OFTEN,
+				0, 0, src->width, src->height, &addr);
+		if (err)
+			goto out;
+
+		cursor = drm_kms_cursor_upload(drm, src, addr);
+
+		gralloc_drm_bo_unlock(bo);
+
+		if (!cursor) {
+			err = -ENOMEM;
+			goto out;
+		}
+	}
+
+	/* nothing changes */
+	if (output->cursor == cursor && (!cursor ||
+		(output->cursor_hot_x == hot_x &&
+		 output->cursor_hot_y == hot_y)))
+		goto out;
+
+	if (cursor) {
+		uint32_t gem = cursor->bo->fb_handle;
+
+		err = drmModeSetCursor2(drm->fd, output->crtc_id, gem,
+				drm->cursor_width, drm->cursor_height,
+				hot_x, hot_y);
+		/* kernels without cursor hotspots */
+		if (err)
+			err = drmModeSetCursor(drm->fd, output->crtc_id, gem,
+					drm->cursor_width, drm->cursor_height);
+	}
+	else {
+		err = drmModeSetCursor(drm->fd, output->crtc_id, 0, 0, 0);
+	}
+
+	if (err) {
+		ALOGE("failed to set cursor on crtc %d (%s)",
+			output->crtc_id, strerror(errno));
+		err = -errno;
+		goto out;
+	}
+
+	output->cursor = cursor;
+	output->cursor_hot_x = hot_x;
+	output->cursor_hot_y = hot_y;
+
+out:
+	pthread_mutex_unlock(&drm->cursor_mutex);
+
+	return err;
+}
+
+/*
+ * Interface for HWC, used to move the hotspot of the cursor of a display
+ * to (x, y).
+ */
+int gralloc_drm_move_cursor(struct gralloc_drm_t *drm, int disp,
+	int x, int y)
+{
+	struct gralloc_drm_output *output = drm_kms_get_output(drm, disp);
+	int err;
+
+	if (!output || !output->active)
+		return -EINVAL;
+
+	pthread_mutex_lock(&drm->cursor_mutex);
+	err = drmModeMoveCursor(drm->fd, output->crtc_id,
+			x - output->cursor_hot_x, y - output->cursor_hot_y);
+	pthread_mutex_unlock(&drm->cursor_mutex);
+
+	return (err) ? -errno : 0;
+}
+
+/*
+ * Hide the cursors and free the cursor bo's.
+ */
+static void drm_kms_cursor_fini(struct gralloc_drm_t *drm)
+{
+	int i;
+
+	pthread_mutex_lock(&drm->cursor_mutex);
+
+	for (i = 0; i < drm->output_count; i++) {
+		struct gralloc_drm_output *output = &drm->outputs[i];
+
+		if (output->cursor)
+			drmModeSetCursor(drm->fd, output->crtc_id, 0, 0, 0);
+		output->cursor = NULL;
+	}
+
+	for (i = 0; i < GRALLOC_DRM_CURSOR_CACHE_SIZE; i++) {
+		if (drm->cursors[i].bo)
+			gralloc_drm_bo_decref(drm->cursors[i].bo);
+		drm->cursors[i].bo = NULL;
+		free(drm->cursors[i].image);
+		drm->cursors[i].image = NULL;
+	}
+
+	pthread_mutex_unlock(&drm->cursor_mutex);
+}
+
+/*
+ * Wait at most timeout ms for DRM events and dispatch them.  Return 1 if
+ * events were dispatched, 0 on timeout, or negative on error.  The caller
+ * must hold event_mutex.
+ */
+static int drm_kms_handle_events(struct gralloc_drm_t *drm, int timeout)
+{
+	struct pollfd pfd;
+	int ret;
+
+	pfd.fd = drm->fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+
+	do {
+		ret = poll(&pfd, 1, timeout);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret <= 0)
+		return ret;
+
+	return (drmHandleEvent(drm->fd, &drm->evctx)) ? -EIO : 1;
+}
+
+static void drm_kms_handle_uevents(struct gralloc_drm_t *drm);
+
+/*
+ * Carry out a shutdown asked for by a signal, then let the signal take the
+ * process down.
+ */
+static void drm_kms_handle_shutdown(struct gralloc_drm_t *drm)
+{
+	unsigned char sig;
+
+	if (drm->shutdown_pipe[0] < 0 ||
+	    read(drm->shutdown_pipe[0], &sig, 1) != 1)
+		return;
+
+	ALOGI("shutting down the displays on signal %d", sig);
+	gralloc_drm_shutdown_kms(drm);
+
+	signal(sig, SIG_DFL);
+	kill(getpid(), sig);
+}
+
+/*
+ * Thread that dispatches DRM events, so that posts queued for a vblank are
+ * carried out on time even when nobody is posting.  Hotplug uevents are
+ * dispatched from here too when there is no hotplug thread.
+ */
+static void *drm_kms_event_loop(void *data)
+{
+	struct gralloc_drm_t *drm = (struct gralloc_drm_t *) data;
+	struct pollfd fds[4];
+
+	fds[0].fd = drm->fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = drm->event_pipe[0];
+	fds[1].events = POLLIN;
+	/* ignored by poll when there is no uevent socket or shutdown pipe */
+	fds[2].fd = (drm->hotplug_pipe[1] < 0) ? drm->uevent_fd : -1;
+	fds[2].events = POLLIN;
+	fds[3].fd = drm->shutdown_pipe[0];
+	fds[3].events = POLLIN;
+
+	while (1) {
+		fds[0].revents = fds[1].revents = 0;
+		fds[2].revents = fds[3].revents = 0;
+		if (poll(fds, 4, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			ALOGE("failed to poll for DRM events (%s)", strerror(errno));
+			break;
+		}
+
+		/* asked to quit */
+		if (fds[1].revents)
+			break;
+
+		/* a signal is taking the process down */
+		if (fds[3].revents)
+			drm_kms_handle_shutdown(drm);
+
+		/* the events may have been dispatched by a waiting poster */
+		if (fds[0].revents) {
+			pthread_mutex_lock(&drm->event_mutex);
+			drm_kms_handle_events(drm, 0);
+			pthread_mutex_unlock(&drm->event_mutex);
+		}
+
+		/* probing connectors is slow, after the queued posts */
+		if (fds[2].revents)
+			drm_kms_handle_uevents(drm);
+	}
+
+	return NULL;
+}
+
+/*
+ * Thread that probes connectors on hotplug uevents.  Reading the EDID of a
+ * plugged display takes long, and would hold up the posts carried out by
+ * the thread dispatching DRM events.
+ */
+static void *drm_kms_hotplug_loop(void *data)
+{
+	struct gralloc_drm_t *drm = (struct gralloc_drm_t *) data;
+	struct pollfd fds[2];
+
+	fds[0].fd = drm->uevent_fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = drm->hotplug_pipe[0];
+	fds[1].events = POLLIN;
+
+	while (1) {
+		fds[0].revents = fds[1].revents = 0;
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			ALOGE("failed to poll for uevents (%s)", strerror(errno));
+			break;
+		}
+
+		/* asked to quit */
+		if (fds[1].revents)
+			break;
+
+		if (fds[0].revents)
+			drm_kms_handle_uevents(drm);
+	}
+
+	return NULL;
+}
+
+/*
+ * Stop the hotplug thread.
+ */
+static void drm_kms_stop_hotplug_thread(struct gralloc_drm_t *drm)
+{
+	if (drm->hotplug_pipe[1] < 0)
+		return;
+
+	write(drm->hotplug_pipe[1], "q", 1);
+	pthread_join(drm->hotplug_thread, NULL);
+	close(drm->hotplug_pipe[0]);
+	close(drm->hotplug_pipe[1]);
+	drm->hotplug_pipe[0] = drm->hotplug_pipe[1] = -1;
+}
+
+/*
+ * Stop the event thread.  Events must be dispatched by someone else after
+ * this.
+ */
+static void drm_kms_stop_event_thread(struct gralloc_drm_t *drm)
+{
+	if (drm->event_pipe[1] < 0)
+		return;
+
+	write(drm->event_pipe[1], "q", 1);
+	pthread_join(drm->event_thread, NULL);
+	close(drm->event_pipe[0]);
+	close(drm->event_pipe[1]);
+	drm->event_pipe[0] = drm->event_pipe[1] = -1;
+}
+
+/*
+ * Return a pollable fd for display events, such as flip and vblank
+ * completions, and hotplug when there is no hotplug thread.  The caller
+ * takes over event dispatching and must call gralloc_drm_handle_events
+ * whenever the fd becomes readable; the internal event thread is stopped.
+ */
+int gralloc_drm_get_event_fd(struct gralloc_drm_t *drm)
+{
+	if (drm->event_fd < 0)
+		return -EINVAL;
+
+	drm_kms_stop_event_thread(drm);
+
+	return drm->event_fd;
+}
+
+/*
+ * Dispatch pending display events without blocking.  Event callbacks are
+ * called from here, but for hotplug ones, which are called from the hotplug
+ * thread when there is one.
+ */
+int gralloc_drm_handle_events(struct gralloc_drm_t *drm)
+{
+	int ret;
+
+	drm_kms_handle_shutdown(drm);
+
+	pthread_mutex_lock(&drm->event_mutex);
+	ret = drm_kms_handle_events(drm, 0);
+	pthread_mutex_unlock(&drm->event_mutex);
+
+	if (drm->hotplug_pipe[1] < 0)
+		drm_kms_handle_uevents(drm);
+
+	return (ret < 0) ? ret : 0;
+}
+
+/*
+ * Set the callbacks for display events.  Flip and vblank callbacks are
+ * called with the posting state locked and must not post or wait for a
+ * post.
+ */
+void gralloc_drm_set_event_callbacks(struct gralloc_drm_t *drm,
+		const struct gralloc_drm_event_callbacks_t *callbacks,
+		void *data)
+{
+	pthread_mutex_lock(&drm->event_mutex);
+	if (callbacks)
+		drm->event_callbacks = *callbacks;
+	else
+		memset(&drm->event_callbacks, 0, sizeof(drm->event_callbacks));
+	drm->event_data = data;
+	pthread_mutex_unlock(&drm->event_mutex);
+}
+
+/*
+ * Find a free overlay on the pipe of an output that can scale a format.
+ * The lowest one is taken, leaving the planes above it to HWC layers.
+ */
+static struct gralloc_drm_plane_t *drm_kms_find_free_plane(
+		struct gralloc_drm_t *drm,
+		const struct gralloc_drm_output *output, int hal_format)
+{
+	struct gralloc_drm_plane_t *best = NULL;
+	uint32_t format = drm_format_from_hal(hal_format);
+	unsigned int i, j;
+
+	for (i = 0; drm->planes && i < drm->plane_resources->count_planes; i++) {
+		struct gralloc_drm_plane_t *plane = &drm->planes[i];
+
+		if (!plane->overlay || plane->no_scaling || plane->reserved ||
+		    plane->active || plane->handle ||
+		    !is_plane_supported(plane, output->pipe))
+			continue;
+
+		for (j = 0; j < plane->drm_plane->count_formats; j++)
+			if (plane->drm_plane->formats[j] == format)
+				break;
+		if (j >= plane->drm_plane->count_formats)
+			continue;
+
+		if (!best || plane->zpos < best->zpos)
+			best = plane;
+	}
+
+	return best;
+}
+
+/*
+ * Compute the part of a bo that was rendered to, and where it goes when
+ * stretched over an output with its aspect ratio kept.
+ */
+static void drm_kms_fit_rect(const struct gralloc_drm_bo_t *bo,
+		const struct gralloc_drm_output *output,
+		uint32_t *src_w, uint32_t *src_h,
+		uint32_t *dst_x, uint32_t *dst_y,
+		uint32_t *dst_w, uint32_t *dst_h)
+{
+	*src_w = bo->handle->width;
+	*src_h = bo->handle->height;
+	*dst_w = output->mode.hdisplay;
+	*dst_h = output->mode.vdisplay;
+
+	/* only the top-left of the bo is rendered to at lower sizes */
+	if (bo->render_width && bo->render_width < *src_w)
+		*src_w = bo->render_width;
+	if (bo->render_height && bo->render_height < *src_h)
+		*src_h = bo->render_height;
+
+	/* letterbox or pillarbox */
+	if ((uint64_t) *src_w * *dst_h > (uint64_t) *dst_w * *src_h)
+		*dst_h = (uint64_t) *src_h * *dst_w / *src_w;
+	else
+		*dst_w = (uint64_t) *src_w * *dst_h / *src_h;
+
+	*dst_x = (output->mode.hdisplay - *dst_w) / 2;
+	*dst_y = (output->mode.vdisplay - *dst_h) / 2;
+}
+
+/*
+ * Scan out a bo through a plane on an output, stretched over the mode with
+ * its aspect ratio kept.
+ */
+static int drm_kms_fit_plane(struct gralloc_drm_t *drm,
+		struct gralloc_drm_plane_t *plane,
+		struct gralloc_drm_output *output,
+		struct gralloc_drm_bo_t *bo)
+{
+	uint32_t src_w, src_h, dst_x, dst_y, dst_w, dst_h;
+	int ret;
+
+	drm_kms_fit_rect(bo, output, &src_w, &src_h,
+			&dst_x, &dst_y, &dst_w, &dst_h);
+
+	ret = drmModeSetPlane(drm->fd, plane->drm_plane->plane_id,
+			output->crtc_id, bo->fb_id, 0,
+			dst_x, dst_y, dst_w, dst_h,
+			0, 0, src_w << 16, src_h << 16);
+	if (ret)
+		ALOGE("failed to scale fb %d with plane %d (%s)",
+			bo->fb_id, plane->drm_plane->plane_id,
+			strerror(errno));
+
+	return ret;
+}
+
+/*
+ * Scan out a bo through the scaler plane.
+ */
+static int drm_kms_scale_post(struct gralloc_drm_t *drm,
+		struct gralloc_drm_bo_t *bo)
+{
+	return drm_kms_fit_plane(drm, drm->scaler, drm->primary, bo);
+}
+
+/*
+ * Fill a bo with black.
+ */
+static void drm_kms_clear_bo(struct gralloc_drm_bo_t *bo)
+{
+	void *addr;
+
+	if (!gralloc_drm_bo_lock(bo, GRALLOC_USAGE_SW_WRITE_OFTEN, 0, 0,
+			bo->handle->width, bo->handle->height, &addr)) {
+		memset(addr, 0, bo->handle->stride * bo->handle->height);
+		gralloc_drm_bo_unlock(bo);
+	}
+}
+
+/*
+ * Return the refresh rate of a mode in mHz, from its timings, so that
+ * 59.94 Hz is told apart from 60 Hz.
+ */
+static int drm_kms_mode_mhz(const drmModeModeInfo *mode)
+{
+	uint64_t num = (uint64_t) mode->clock * 1000000;
+	uint64_t den = (uint64_t) mode->htotal * mode->vtotal;
+
+	if (!den)
+		return mode->vrefresh * 1000;
+
+	if (mode->flags & DRM_MODE_FLAG_INTERLACE)
+		num *= 2;
+	if (mode->flags & DRM_MODE_FLAG_DBLSCAN)
+		den *= 2;
+	if (mode->vscan > 1)
+		den *= mode->vscan;
+
+	return (int) ((num + den / 2) / den);
+}
+
+/*
+ * Allocate the copies of primary frames hdmi is updated from when it does
+ * not share the primary fbs.  The caller must hold hdmi_mutex.
+ */
+static void drm_kms_clone_alloc_copies(struct gralloc_drm_t *drm)
+{
+	struct gralloc_drm_bo_t *copies[GRALLOC_DRM_CLONE_COPIES];
+	int i, count;
+
+	pthread_mutex_lock(&drm->clone_mutex);
+	count = drm->clone_copy_count;
+	pthread_mutex_unlock(&drm->clone_mutex);
+	if (count)
+		return;
+
+	for (i = 0; i < GRALLOC_DRM_CLONE_COPIES; i++) {
+		copies[i] = gralloc_drm_bo_create(drm,
+				drm->render_width, drm->render_height,
+				drm->primary->fb_format,
+				GRALLOC_USAGE_HW_FB | GRALLOC_USAGE_HW_RENDER);
+		if (copies[i] && gralloc_drm_bo_add_fb(copies[i])) {
+			gralloc_drm_bo_decref(copies[i]);
+			copies[i] = NULL;
+		}
+		if (!copies[i])
+			break;
+	}
+
+	pthread_mutex_lock(&drm->clone_mutex);
+	memcpy(drm->clone_copies, copies, sizeof(copies[0]) * i);
+	drm->clone_copy_count = i;
+	pthread_mutex_unlock(&drm->clone_mutex);
+
+	if (i < GRALLOC_DRM_CLONE_COPIES)
+		ALOGE("failed to allocate the hdmi clone copies");
+}
+
+/*
+ * Free the copies of primary frames, once hdmi no longer shows them.  The
+ * caller must hold hdmi_mutex.
+ */
+static void drm_kms_clone_free_copies(struct gralloc_drm_t *drm)
+{
+	struct gralloc_drm_bo_t *copies[GRALLOC_DRM_CLONE_COPIES];
+	int i, count;
+
+	/* a post may be copying to one */
+	pthread_mutex_lock(&drm->clone_mutex);
+	count = drm->clone_copy_count;
+	memcpy(copies, drm->clone_copies, sizeof(copies[0]) * count);
+	drm->clone_copy_count = 0;
+	drm->clone_next = NULL;
+	drm->clone_taken = NULL;
+	drm->clone_shown = NULL;
+	drm->clone_flipping = NULL;
+	drm->clone_shares = 0;
+	pthread_mutex_unlock(&drm->clone_mutex);
+
+	for (i = 0; i < count; i++)
+		gralloc_drm_bo_decref(copies[i]);
+}
+
+/*
+ * Choose how the primary frames get to hdmi.  The primary fbs are scanned
+ * out as is only when the modes match and hdmi flips with the primary at
+ * the same refresh rate.  Otherwise hdmi is updated at its own pace from
+ * copies: shown as is when the modes match, scaled by an overlay plane
+ * when they do not, or scaled to the private fb when there is no plane.
+ * The caller must hold hdmi_mutex.
+ */
+static void drm_kms_clone_setup(struct gralloc_drm_t *drm)
+{
+	struct gralloc_drm_output *hdmi = drm->hdmi;
+	int same_mode, same_rate;
+
+	if (hdmi->clone_plane) {
+		hdmi->clone_plane->reserved = 0;
+		hdmi->clone_plane = NULL;
+	}
+
+	same_mode = (hdmi->mode.hdisplay == drm->render_width &&
+		     hdmi->mode.vdisplay == drm->render_height &&
+		     hdmi->fb_format == drm->primary->fb_format &&
+		     !drm->drs.enabled);
+	same_rate = (drm_kms_mode_mhz(&hdmi->mode) ==
+		     drm_kms_mode_mhz(&drm->primary->mode));
+
+	if (same_mode && same_rate && drm->swap_mode == DRM_SWAP_FLIP) {
+		hdmi->clone = DRM_CLONE_SHARED;
+	}
+	else if (same_mode) {
+		hdmi->clone = DRM_CLONE_COPY;
+	}
+	else {
+		hdmi->clone_plane = drm_kms_find_free_plane(drm, hdmi,
+				drm->primary->fb_format);
+		if (hdmi->clone_plane) {
+			hdmi->clone_plane->reserved = 1;
+			hdmi->clone = DRM_CLONE_PLANE;
+		}
+		else {
+			hdmi->clone = DRM_CLONE_BLIT;
+
+			/* blit to a back buffer not to tear the shown one */
+			if (!hdmi->clone_back) {
+				hdmi->clone_back = gralloc_drm_bo_create(drm,
+					hdmi->mode.hdisplay, hdmi->mode.vdisplay,
+					hdmi->fb_format,
+					GRALLOC_USAGE_SW_WRITE_OFTEN |
+					GRALLOC_USAGE_HW_RENDER);
+				if (hdmi->clone_back &&
+				    gralloc_drm_bo_add_fb(hdmi->clone_back)) {
+					gralloc_drm_bo_decref(hdmi->clone_back);
+					hdmi->clone_back = NULL;
+				}
+			}
+			if (hdmi->clone_back)
+				drm_kms_clear_bo(hdmi->clone_back);
+		}
+	}
+
+	/* shown while the first frame is on its way */
+	drm_kms_clear_bo(hdmi->bo);
+
+	if (hdmi->clone != DRM_CLONE_SHARED)
+		drm_kms_clone_alloc_copies(drm);
+
+	pthread_mutex_lock(&drm->clone_mutex);
+	drm->clone_shares = (hdmi->clone == DRM_CLONE_SHARED);
+	drm->clone_shown = NULL;
+	pthread_mutex_unlock(&drm->clone_mutex);
+
+	ALOGD("hdmi clone by %s",
+		(hdmi->clone == DRM_CLONE_SHARED) ? "sharing the fb" :
+		(hdmi->clone == DRM_CLONE_COPY) ? "copies" :
+		(hdmi->clone == DRM_CLONE_PLANE) ? "plane scaling" : "blit");
+}
+
+/*
+ * Flip hdmi to a fb, with an event waking up the clone worker.  copy is
+ * the copy of a primary frame the fb belongs to, or NULL for the private
+ * fbs.
+ */
+static int drm_kms_clone_flip(struct gralloc_drm_t *drm, uint32_t fb_id,
+		struct gralloc_drm_bo_t *copy)
+{
+	struct gralloc_drm_output *hdmi = drm->hdmi;
+	int ret;
+
+	/* set before the flip, the event may come before it returns */
+	pthread_mutex_lock(&drm->clone_mutex);
+	hdmi->flip_pending = 1;
+	drm->clone_flipping = copy;
+	pthread_mutex_unlock(&drm->clone_mutex);
+
+	ret = drmModePageFlip(drm->fd, hdmi->crtc_id, fb_id,
+			DRM_MODE_PAGE_FLIP_EVENT, (void *) hdmi);
+	if (ret) {
+		pthread_mutex_lock(&drm->clone_mutex);
+		hdmi->flip_pending = 0;
+		drm->clone_flipping = NULL;
+		pthread_mutex_unlock(&drm->clone_mutex);
+	}
+
+	return ret;
+}
+
+/*
+ * Show the copy the clone worker took on hdmi.  The crtc is set when
+ * modeset is true, and flipped when the kernel can flip.  This is called
+ * by the clone worker, which must hold hdmi_mutex.
+ */
+static void drm_kms_clone_show(struct gralloc_drm_t *drm, int modeset)
+{
+	struct gralloc_drm_output *hdmi = drm->hdmi;
+	struct gralloc_drm_bo_t *copy, *shown = NULL;
+	int flip = (drm->mode_page_flip && !modeset);
+	int ret = 0;
+
+	if (!hdmi->active || drm->hdmi_mode != HDMI_CLONED || !hdmi->bo) {
+		pthread_mutex_lock(&drm->clone_mutex);
+		drm->clone_taken = NULL;
+		pthread_mutex_unlock(&drm->clone_mutex);
+		return;
+	}
+
+	if (modeset) {
+		drm_kms_clone_setup(drm);
+		ret = drm_kms_set_crtc(drm, hdmi, hdmi->bo->fb_id);
+	}
+
+	/* taken again, the copies may have been freed on the way */
+	pthread_mutex_lock(&drm->clone_mutex);
+	copy = drm->clone_taken;
+	pthread_mutex_unlock(&drm->clone_mutex);
+	if (!copy || ret)
+		goto out;
+
+	switch (hdmi->clone) {
+	case DRM_CLONE_SHARED:
+		/* flipped along with the primary by drm_kms_clone_share */
+		break;
+	case DRM_CLONE_COPY:
+		if (flip) {
+			ret = drm_kms_clone_flip(drm, copy->fb_id, copy);
+		}
+		else {
+			ret = drm_kms_set_crtc(drm, hdmi, copy->fb_id);
+			shown = copy;
+		}
+		break;
+	case DRM_CLONE_PLANE:
+		ret = drm_kms_fit_plane(drm, hdmi->clone_plane, hdmi, copy);
+		shown = copy;
+		break;
+	case DRM_CLONE_BLIT:
+	default:
+		{
+			struct gralloc_drm_bo_t *dst = (hdmi->clone_back) ?
+				hdmi->clone_back : hdmi->bo;
+			uint32_t src_w, src_h, dst_x, dst_y, dst_w, dst_h;
+
+			/* fill the mode, the borders are black from setup */
+			drm_kms_fit_rect(copy, hdmi, &src_w, &src_h,
+					&dst_x, &dst_y, &dst_w, &dst_h);
+			if (gralloc_drm_bo_scale(dst, copy,
+					dst_x, dst_y, dst_w, dst_h,
+					0, 0, src_w, src_h))
+				ALOGE("failed to scale fb %d to hdmi",
+						copy->fb_id);
+
+			if (!flip)
+				ret = drm_kms_set_crtc(drm, hdmi, dst->fb_id);
+			else
+				ret = drm_kms_clone_flip(drm, dst->fb_id, NULL);
+
+			/* the back buffer is now shown */
+			if (!ret && dst != hdmi->bo) {
+				hdmi->clone_back = hdmi->bo;
+				hdmi->bo = dst;
+			}
+		}
+		break;
+	}
+
+	if (ret && errno != EBUSY)
+		ALOGE("failed to clone fb %d to hdmi (%s) (crtc %d)",
+			copy->fb_id, strerror(errno), hdmi->crtc_id);
+
+out:
+	pthread_mutex_lock(&drm->clone_mutex);
+	drm->clone_taken = NULL;
+	if (modeset || (!ret && shown))
+		drm->clone_shown = (ret) ? NULL : shown;
+	pthread_mutex_unlock(&drm->clone_mutex);
+}
+
+/* longest wait for a clone flip, in ms */
+#define CLONE_FLIP_TIMEOUT 100
+
+/*
+ * Wait for the clone flip in flight.  This paces the worker at the hdmi
+ * refresh rate.  The caller must hold clone_mutex.
+ */
+static void drm_kms_clone_wait_flip(struct gralloc_drm_t *drm)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_nsec += CLONE_FLIP_TIMEOUT * 1000000LL;
+	if (ts.tv_nsec >= NSEC_PER_SEC) {
+		ts.tv_sec++;
+		ts.tv_nsec -= NSEC_PER_SEC;
+	}
+
+	while (drm->hdmi->flip_pending && !drm->clone_quit) {
+		if (pthread_cond_timedwait(&drm->clone_cond,
+				&drm->clone_mutex, &ts) == ETIMEDOUT) {
+			ALOGE("no event for the hdmi clone flip");
+			drm->hdmi->flip_pending = 0;
+
+			/* take the flip as done */
+			if (drm->clone_flipping) {
+				drm->clone_shown = drm->clone_flipping;
+				drm->clone_flipping = NULL;
+			}
+		}
+	}
+}
+
+/*
+ * Drop the primary bos held for a hdmi sharing the primary fbs, once hdmi
+ * no longer scans them out.  The caller must hold event_mutex.
+ */
+static void drm_kms_clone_drop_fronts(struct gralloc_drm_t *drm)
+{
+	if (drm->clone_front) {
+		gralloc_drm_bo_decref(drm->clone_front);
+		drm->clone_front = NULL;
+	}
+	if (drm->clone_pending) {
+		gralloc_drm_bo_decref(drm->clone_pending);
+		drm->clone_pending = NULL;
+	}
+}
+
+/*
+ * Thread that shows the latest copy of a primary frame on hdmi, and sets
+ * the hdmi crtc.
+ */
+static void *drm_kms_clone_loop(void *data)
+{
+	struct gralloc_drm_t *drm = (struct gralloc_drm_t *) data;
+
+	pthread_mutex_lock(&drm->clone_mutex);
+	while (!drm->clone_quit) {
+		int modeset, shares;
+
+		if (!drm->clone_next && !drm->clone_modeset) {
+			pthread_cond_wait(&drm->clone_cond, &drm->clone_mutex);
+			continue;
+		}
+
+		drm->clone_taken = drm->clone_next;
+		modeset = drm->clone_modeset;
+		drm->clone_next = NULL;
+		drm->clone_modeset = 0;
+		drm->clone_busy = 1;
+		pthread_mutex_unlock(&drm->clone_mutex);
+
+		pthread_mutex_lock(&drm->hdmi_mutex);
+		drm_kms_clone_show(drm, modeset);
+		pthread_mutex_unlock(&drm->hdmi_mutex);
+
+		pthread_mutex_lock(&drm->clone_mutex);
+		shares = drm->clone_shares;
+		pthread_mutex_unlock(&drm->clone_mutex);
+
+		/* the crtc was set with the private fb */
+		if (modeset) {
+			pthread_mutex_lock(&drm->event_mutex);
+			drm_kms_clone_drop_fronts(drm);
+			pthread_mutex_unlock(&drm->event_mutex);
+		}
+
+		pthread_mutex_lock(&drm->clone_mutex);
+		drm->clone_busy = 0;
+		if (!shares)
+			drm_kms_clone_wait_flip(drm);
+	}
+	pthread_mutex_unlock(&drm->clone_mutex);
+
+	return NULL;
+}
+
+/*
+ * Copy a primary frame for the clone worker, to a copy hdmi does not show,
+ * replacing the frame the worker has not got to.  The copy is made by the
+ * GPU in order with later rendering to bo, so bo can go back to the
+ * swapchain right away.  The caller must hold event_mutex and clone_mutex.
+ */
+static void drm_kms_clone_copy(struct gralloc_drm_t *drm,
+		struct gralloc_drm_bo_t *bo)
+{
+	struct gralloc_drm_bo_t *copy = drm->clone_next;
+	int i, w, h;
+
+	for (i = 0; !copy && i < drm->clone_copy_count; i++) {
+		struct gralloc_drm_bo_t *c = drm->clone_copies[i];
+
+		if (c != drm->clone_taken && c != drm->clone_shown &&
+		    c != drm->clone_flipping)
+			copy = c;
+	}
+
+	if (drm->clone_next || (!copy && drm->clone_copy_count)) {
+		drm->clone_dropped++;
+		ALOGV("hdmi clone is behind, %u frames dropped",
+				drm->clone_dropped);
+	}
+	if (!copy)
+		return;
+
+	w = bo->handle->width;
+	h = bo->handle->height;
+	if (w > copy->handle->width)
+		w = copy->handle->width;
+	if (h > copy->handle->height)
+		h = copy->handle->height;
+	if (gralloc_drm_bo_scale(copy, bo, 0, 0, w, h, 0, 0, w, h)) {
+		ALOGE("failed to copy fb %d for hdmi", bo->fb_id);
+		drm->clone_next = NULL;
+		return;
+	}
+
+	copy->render_width = bo->render_width;
+	copy->render_height = bo->render_height;
+	drm->clone_next = copy;
+}
+
+/*
+ * Hand a primary frame to the clone worker.  The worker is started on the
+ * first frame.  The caller must hold event_mutex.
+ */
+static void drm_kms_clone_queue(struct gralloc_drm_t *drm,
+		struct gralloc_drm_bo_t *bo, int modeset)
+{
+	if (!bo || drm->shutdown || drm->hdmi_mode != HDMI_CLONED ||
+	    !drm->hdmi->active)
+		return;
+
+	pthread_mutex_lock(&drm->clone_mutex);
+
+	if (!drm->clone_thread_started) {
+		drm->clone_quit = 0;
+		if (pthread_create(&drm->clone_thread, NULL,
+					drm_kms_clone_loop, drm)) {
+			ALOGE("failed to create hdmi clone thread");
+			pthread_mutex_unlock(&drm->clone_mutex);
+			return;
+		}
+		drm->clone_thread_started = 1;
+	}
+
+	drm->clone_modeset |= modeset;
+
+	/* a shared fb is flipped along with the primary */
+	if (!drm->clone_shares || drm->clone_modeset)
+		drm_kms_clone_copy(drm, bo);
+
+	pthread_cond_signal(&drm->clone_cond);
+	pthread_mutex_unlock(&drm->clone_mutex);
+}
+
+/*
+ * Flip a hdmi sharing the primary fbs to bo, after the primary was flipped
+ * to it.  Both flips are waited for before the next one, and land together
+ * as the refresh rates match.  The caller must hold event_mutex.
+ */
+static void drm_kms_clone_share(struct gralloc_drm_t *drm,
+		struct gralloc_drm_bo_t *bo)
+{
+	struct gralloc_drm_output *hdmi = drm->hdmi;
+	int shares;
+
+	pthread_mutex_lock(&drm->clone_mutex);
+	shares = (drm->clone_shares && !drm->clone_modeset &&
+		  !drm->clone_busy);
+	pthread_mutex_unlock(&drm->clone_mutex);
+	if (!shares || drm->clone_pending)
+		return;
+
+	/* never wait for a hotplug; hdmi keeps the last frame */
+	if (pthread_mutex_trylock(&drm->hdmi_mutex))
+		return;
+
+	if (hdmi->active && hdmi->clone == DRM_CLONE_SHARED) {
+		if (!drmModePageFlip(drm->fd, hdmi->crtc_id, bo->fb_id,
+				DRM_MODE_PAGE_FLIP_EVENT, (void *) hdmi)) {
+			gralloc_drm_bo_incref(bo);
+			drm->clone_pending = bo;
+		}
+		else if (errno != EBUSY) {
+			ALOGE("failed to flip hdmi to fb %d (%s) (crtc %d)",
+				bo->fb_id, strerror(errno), hdmi->crtc_id);
+		}
+	}
+
+	pthread_mutex_unlock(&drm->hdmi_mutex);
+}
+
+/*
+ * Stop the clone worker and drop the frame it has not got to.
+ */
+static void drm_kms_stop_clone_thread(struct gralloc_drm_t *drm)
+{
+	if (!drm->clone_thread_started)
+		return;
+
+	pthread_mutex_lock(&drm->clone_mutex);
+	drm->clone_quit = 1;
+	pthread_cond_signal(&drm->clone_cond);
+	pthread_mutex_unlock(&drm->clone_mutex);
+	pthread_join(drm->clone_thread, NULL);
+	drm->clone_thread_started = 0;
+
+	drm->clone_next = NULL;
+	drm->clone_modeset = 0;
+}
+
+/*
+ * Schedule a page flip.
+ */
+static int drm_kms_page_flip(struct gralloc_drm_t *drm,
+		struct gralloc_drm_bo_t *bo)
+{
+	int ret;
+
+	/*
+	 * there is another flip pending, or a post is queued for a vblank;
+	 * a hdmi sharing the primary fbs flips in lockstep, any other clone
+	 * is updated by the clone worker at its own pace
+	 */
+	while (drm->next_front || drm->vblank_pending || drm->clone_pending) {
+		drm->waiting_flip = 1;
+		ret = drm_kms_handle_events(drm, 1000);
+		drm->waiting_flip = 0;
+		if (ret <= 0) {
+			/* record an error and break */
+			ALOGE("no event for the pending flip or post");
+			drm->vblank_pending = 0;
+			if (drm->queued_post) {
+				gralloc_drm_bo_decref(drm->queued_post);
+				drm->queued_post = NULL;
+			}
+			if (drm->next_front) {
+				drm->current_front = drm->next_front;
+				drm->next_front = NULL;
+			}
+			if (drm->clone_pending) {
+				if (drm->clone_front)
+					gralloc_drm_bo_decref(drm->clone_front);
+				drm->clone_front = drm->clone_pending;
+				drm->clone_pending = NULL;
+			}
+		}
+	}
+
+	if (!bo)
+		return 0;
+
+	drm_kms_clone_queue(drm, bo, 0);
+
+	/* set planes to be displayed */
+	gralloc_drm_set_planes(drm, drm->primary);
+
+	ret = drmModePageFlip(drm->fd, drm->primary->crtc_id, bo->fb_id,
+			DRM_MODE_PAGE_FLIP_EVENT, (void *) drm->primary);
+	if (ret) {
+		ALOGE("failed to perform page flip for primary (%s) (crtc %d fb %d))",
+			strerror(errno), drm->primary->crtc_id, bo->fb_id);
+		/* try to set mode for next frame */
 		if (errno != EBUSY)
 			drm->first_post = 1;
 	}
-	else
-		drm->next_front = bo;
+	else {
+		drm->next_front = bo;
+		drm_kms_clone_share(drm, bo);
+	}
+
+	return ret;
+}
+
+/* render size scale of the max size */
+#define DRS_SCALE_ONE 256
+/* missed deadlines that shrink the render size */
+#define DRS_SHRINK_MISSES 2
+/* met deadlines that forgive an isolated miss */
+#define DRS_FORGIVE_FRAMES 30
+/* met deadlines, with time to spare, that grow the render size */
+#define DRS_GROW_FRAMES 120
+
+/*
+ * Return a render size dimension at a scale, within the bounds.
+ */
+static uint32_t drm_kms_drs_dim(uint32_t min, uint32_t max, int scale)
+{
+	uint32_t dim = (uint64_t) max * scale / DRS_SCALE_ONE;
+
+	/* friendly to GPU tiling */
+	dim &= ~7;
+
+	if (dim < min)
+		dim = min;
+	if (dim > max)
+		dim = max;
+
+	return dim;
+}
+
+/*
+ * Feed the time left before the deadline of a post to the dynamic
+ * resolution controller.  The render size shrinks quickly when deadlines
+ * are missed and grows slowly when they are met with time to spare.  The
+ * caller must hold event_mutex.
+ */
+static void drm_kms_drs_update(struct gralloc_drm_t *drm, int64_t slack,
+		int64_t period)
+{
+	struct gralloc_drm_drs_t *drs = &drm->drs;
+	int scale = drs->scale;
+	uint32_t width, height;
+
+	drs->slack += (slack - drs->slack) / 8;
+
+	if (slack < 0) {
+		drs->frames = 0;
+		if (++drs->misses >= DRS_SHRINK_MISSES) {
+			scale -= scale / 8;
+			drs->misses = 0;
+		}
+	}
+	else {
+		drs->frames++;
+		if (drs->frames % DRS_FORGIVE_FRAMES == 0)
+			drs->misses = 0;
+		if (drs->frames >= DRS_GROW_FRAMES) {
+			if (drs->slack > period / 3)
+				scale += scale / 16 + 1;
+			drs->frames = 0;
+		}
+	}
+
+	if (scale > DRS_SCALE_ONE)
+		scale = DRS_SCALE_ONE;
+
+	width = drm_kms_drs_dim(drs->min_width, drs->max_width, scale);
+	height = drm_kms_drs_dim(drs->min_height, drs->max_height, scale);
+
+	/* do not sink below the bounds */
+	if (width == drs->min_width && height == drs->min_height &&
+	    scale < drs->scale)
+		scale = drs->scale;
+	drs->scale = scale;
+
+	if (width == drs->width && height == drs->height)
+		return;
+
+	ALOGD("render size %ux%u -> %ux%u (slack %lld us)",
+		drs->width, drs->height, width, height,
+		(long long) drs->slack / 1000);
+
+	pthread_mutex_lock(&drm->vsync_mutex);
+	drs->width = width;
+	drs->height = height;
+	pthread_mutex_unlock(&drm->vsync_mutex);
+
+	if (drm->event_callbacks.resize)
+		drm->event_callbacks.resize(drm->event_data, 0, width, height);
+}
+
+/*
+ * Measure how early a post comes before the vblank it is meant for, and
+ * adjust the render size.  The caller must hold event_mutex.
+ */
+static void drm_kms_drs_post(struct gralloc_drm_t *drm)
+{
+	struct gralloc_drm_vsync_t *vsync = &drm->primary->vsync;
+	int64_t deadline, period;
+	int ok;
+
+	pthread_mutex_lock(&drm->vsync_mutex);
+	ok = (vsync->samples > 0);
+	period = vsync->period;
+	deadline = vsync->phase + (int64_t) (int)
+		(drm->last_swap + drm->swap_interval - vsync->seq) * period;
+	pthread_mutex_unlock(&drm->vsync_mutex);
+
+	if (ok)
+		drm_kms_drs_update(drm, deadline - drm_kms_now(drm), period);
+}
+
+/*
+ * Interface for HWC, used to get the size the primary swapchain should be
+ * rendered at.  It is the fb size unless dynamic resolution lowered it, in
+ * which case only the top-left of the buffers is scanned out.
+ */
+void gralloc_drm_get_render_size(struct gralloc_drm_t *drm,
+	uint32_t *width, uint32_t *height)
+{
+	pthread_mutex_lock(&drm->vsync_mutex);
+	if (drm->drs.width) {
+		*width = drm->drs.width;
+		*height = drm->drs.height;
+	}
+	else {
+		*width = drm->render_width;
+		*height = drm->render_height;
+	}
+	pthread_mutex_unlock(&drm->vsync_mutex);
+}
+
+/*
+ * Interface for HWC, used to get the render size for a buffer about to be
+ * rendered to.  The size is recorded in the bo, so that it is scanned out
+ * at the size it was rendered at even if the render size changes before
+ * it is posted.
+ */
+int gralloc_drm_get_buffer_render_size(struct gralloc_drm_t *drm,
+	buffer_handle_t handle, uint32_t *width, uint32_t *height)
+{
+	struct gralloc_drm_bo_t *bo;
+
+	bo = gralloc_drm_bo_from_handle(handle);
+	if (!bo || bo->drm != drm)
+		return -EINVAL;
+
+	pthread_mutex_lock(&drm->vsync_mutex);
+	if (drm->drs.width) {
+		*width = drm->drs.width;
+		*height = drm->drs.height;
+	}
+	else {
+		*width = drm->render_width;
+		*height = drm->render_height;
+	}
+	bo->render_width = *width;
+	bo->render_height = *height;
+	pthread_mutex_unlock(&drm->vsync_mutex);
+
+	return 0;
+}
+
+
+/*
+ * Add a rectangle to a list of n damage rectangles.  When the list is full,
+ * the last rectangle grows to cover it.  Return the new length.
+ */
+static int drm_kms_add_damage(drmModeClip *damage, int n,
+		const drmModeClip *r)
+{
+	if (n < GRALLOC_DRM_MAX_DAMAGE) {
+		damage[n] = *r;
+		return n + 1;
+	}
+
+	if (damage[n - 1].x1 > r->x1)
+		damage[n - 1].x1 = r->x1;
+	if (damage[n - 1].y1 > r->y1)
+		damage[n - 1].y1 = r->y1;
+	if (damage[n - 1].x2 < r->x2)
+		damage[n - 1].x2 = r->x2;
+	if (damage[n - 1].y2 < r->y2)
+		damage[n - 1].y2 = r->y2;
+
+	return n;
+}
+
+/*
+ * Clip the damage of a post to bo, into at most GRALLOC_DRM_MAX_DAMAGE
+ * rectangles.  NULL rects means all of bo is damaged.  Return the number of
+ * rectangles, which is 0 when nothing has changed.
+ */
+static int drm_kms_clip_damage(const struct gralloc_drm_bo_t *bo,
+		const drmModeClip *rects, int count,
+		drmModeClip *damage)
+{
+	int width = bo->handle->width, height = bo->handle->height;
+	int i, n = 0;
+
+	if (!rects) {
+		damage[0].x1 = 0;
+		damage[0].y1 = 0;
+		damage[0].x2 = width;
+		damage[0].y2 = height;
+		return 1;
+	}
+
+	for (i = 0; i < count; i++) {
+		drmModeClip r = rects[i];
+
+		if (r.x2 > width)
+			r.x2 = width;
+		if (r.y2 > height)
+			r.y2 = height;
+		if (r.x1 >= r.x2 || r.y1 >= r.y2)
+			continue;
+
+		n = drm_kms_add_damage(damage, n, &r);
+	}
+
+	return n;
+}
+
+/*
+ * Copy the damage of bo to a front in copy mode, along with the damage the
+ * front has missed while other fronts were copied to.
+ */
+static void drm_kms_copy_blit(struct gralloc_drm_t *drm,
+		struct gralloc_drm_bo_t *front, struct gralloc_drm_bo_t *bo,
+		const drmModeClip *damage, int damage_count)
+{
+	drmModeClip *dirty;
+	int f, g, i, n;
+
+	for (f = 0; f < drm->copy_front_count; f++)
+		if (drm->copy_fronts[f] == front)
+			break;
+	if (f >= drm->copy_front_count)
+		return;
+
+	dirty = drm->copy_dirty[f];
+	n = drm->copy_dirty_count[f];
+	for (i = 0; i < damage_count; i++)
+		n = drm_kms_add_damage(dirty, n, &damage[i]);
+
+	for (i = 0; i < n; i++)
+		gralloc_drm_bo_blit(front, bo,
+				dirty[i].x1, dirty[i].y1,
+				dirty[i].x2, dirty[i].y2,
+				dirty[i].x1, dirty[i].y1,
+				dirty[i].x2, dirty[i].y2);
+	drm->copy_dirty_count[f] = 0;
+
+	/* the other fronts still show what was there */
+	for (g = 0; g < drm->copy_front_count; g++) {
+		if (g == f)
+			continue;
+		for (i = 0; i < damage_count; i++)
+			drm->copy_dirty_count[g] = drm_kms_add_damage(
+					drm->copy_dirty[g],
+					drm->copy_dirty_count[g], &damage[i]);
+	}
+}
+
+/*
+ * Return a front in copy mode that is neither scanned out nor about to be,
+ * or NULL if there is none.
+ */
+static struct gralloc_drm_bo_t *drm_kms_copy_back(struct gralloc_drm_t *drm)
+{
+	int i;
+
+	for (i = 0; i < drm->copy_front_count; i++) {
+		struct gralloc_drm_bo_t *front = drm->copy_fronts[i];
+
+		if (front != drm->current_front &&
+		    front != drm->next_front &&
+		    front != drm->queued_post)
+			return front;
+	}
+
+	return NULL;
+}
+
+/*
+ * Switch to a front in copy mode: flip to it, or set the crtc with it when
+ * the kernel cannot flip.
+ */
+static int drm_kms_copy_show(struct gralloc_drm_t *drm,
+		struct gralloc_drm_bo_t *front)
+{
+	int ret;
+
+	if (drm->mode_page_flip)
+		return drm_kms_page_flip(drm, front);
+
+	ret = drm_kms_set_crtc(drm, drm->primary, front->fb_id);
+	if (!ret)
+		drm->current_front = front;
+	gralloc_drm_set_planes(drm, drm->primary);
+
+	drm_kms_clone_queue(drm, front, 0);
+
+	return ret;
+}
+
+/*
+ * Put a bo on screen using the swap mode.  It is called from
+ * gralloc_drm_bo_post directly, or from vblank_handler when the post was
+ * queued for a vblank.  In copy mode only the damage is copied, as the
+ * front still holds the previous frame.
+ */
+static int drm_kms_commit_post(struct gralloc_drm_t *drm,
+		struct gralloc_drm_bo_t *bo,
+		const drmModeClip *damage, int damage_count)
+{
+	int i, ret;
+
+	switch (drm->swap_mode) {
+	case DRM_SWAP_FLIP:
+		ret = drm_kms_page_flip(drm, bo);
+		break;
+	case DRM_SWAP_COPY:
+		/* with a ring of fronts, bo is a front that has been copied to */
+		if (drm->copy_front_count > 1) {
+			ret = drm_kms_copy_show(drm, bo);
+			break;
+		}
+
+		for (i = 0; i < damage_count; i++)
+			gralloc_drm_bo_blit(drm->current_front, bo,
+					damage[i].x1, damage[i].y1,
+					damage[i].x2, damage[i].y2,
+					damage[i].x1, damage[i].y1,
+					damage[i].x2, damage[i].y2);
+		if (drm->mode_quirk_vmwgfx && damage_count)
+			ret = drmModeDirtyFB(drm->fd, drm->current_front->fb_id,
+					(drmModeClip *) damage, damage_count);
+		ret = 0;
+		gralloc_drm_set_planes(drm, drm->primary);
+
+		/* a shared or scaled front needs no update */
+		drm_kms_clone_queue(drm, drm->current_front, 0);
+		break;
+	case DRM_SWAP_SETCRTC:
+		if (drm->scaler)
+			ret = drm_kms_scale_post(drm, bo);
+		else
+			ret = drm_kms_set_crtc(drm, drm->primary, bo->fb_id);
+
+		/* hwc planes over the scaler too */
+		gralloc_drm_set_planes(drm, drm->primary);
+
+		drm_kms_clone_queue(drm, bo, 0);
+
+		drm->current_front = bo;
+		break;
+	default:
+		/* no-op */
+		ret = 0;
+		break;
+	}
+
+	return ret;
+}
+
+/*
+ * Callback for a vblank event.  Carry out the post queued for it.
+ */
+static void vblank_handler(int fd, unsigned int sequence,
+		unsigned int tv_sec, unsigned int tv_usec,
+		void *user_data)
+{
+	struct gralloc_drm_t *drm = (struct gralloc_drm_t *) user_data;
+	struct gralloc_drm_bo_t *bo = drm->queued_post;
+
+	/* vblank events are requested for the primary crtc only */
+	if (!drm->primary->vrr) {
+		pthread_mutex_lock(&drm->vsync_mutex);
+		drm_kms_vsync_sample(drm->primary, sequence, tv_sec, tv_usec);
+		pthread_mutex_unlock(&drm->vsync_mutex);
+	}
+
+	if (drm->event_callbacks.vblank)
+		drm->event_callbacks.vblank(drm->event_data, 0, sequence,
+			(int64_t) tv_sec * NSEC_PER_SEC + (int64_t) tv_usec * 1000);
+
+	drm->vblank_pending = 0;
+
+	/* nothing to post, the event only paces a repeated frame */
+	if (!bo) {
+		drm->last_swap = sequence;
+		return;
+	}
+
+	drm->queued_post = NULL;
+	/* a flip scheduled now completes on the next vblank */
+	drm->last_swap = sequence + (drm->swap_mode == DRM_SWAP_FLIP);
+
+	drm_kms_commit_post(drm, bo, drm->queued_damage,
+			drm->queued_damage_count);
+	gralloc_drm_bo_decref(bo);
+}
+
+/*
+ * Queue a bo to be posted at the vblank given by the swap interval.  The
+ * post is carried out by vblank_handler, from whichever thread dispatches
+ * the DRM events.  bo may be NULL to only wait for the vblank.  Return
+ * non-zero if no vblank event could be requested, and the caller should
+ * post the bo right away.
+ */
+static int drm_kms_queue_post(struct gralloc_drm_t *drm,
+		struct gralloc_drm_bo_t *bo, int flip)
+{
+	drmVBlank vbl;
+	int ret;
+
+	if (drm->mode_quirk_vmwgfx)
+		return -EINVAL;
+
+	flip = !!flip;
+
+	memset(&vbl, 0, sizeof(vbl));
+	/*
+	 * When not flipping, the post is done by the handler and must not
+	 * happen in the middle of a frame that has already started.  A flip
+	 * is latched on the next vblank so the target may have passed.
+	 */
+	vbl.request.type = DRM_VBLANK_ABSOLUTE | DRM_VBLANK_EVENT;
+	if (!flip)
+		vbl.request.type |= DRM_VBLANK_NEXTONMISS;
+	if (drm->vblank_secondary)
+		vbl.request.type |= DRM_VBLANK_SECONDARY;
+	vbl.request.sequence = drm->last_swap + drm->swap_interval - flip;
+	vbl.request.signal = (unsigned long) drm;
+
+	ret = drmWaitVBlank(drm->fd, &vbl);
+	if (ret) {
+		ALOGW("failed to queue vblank event");
+		return ret;
+	}
+
+	if (bo)
+		gralloc_drm_bo_incref(bo);
+	drm->queued_post = bo;
+	drm->vblank_pending = 1;
+
+	return 0;
+}
+
+/*
+ * Return true if posting bo would not change what is on screen.  In copy
+ * mode bo is copied from and may have new content, so it is never a repeat.
+ */
+static int drm_kms_post_is_repeat(struct gralloc_drm_t *drm,
+		struct gralloc_drm_bo_t *bo)
+{
+	struct gralloc_drm_bo_t *last;
+
+	/* the bo that is, or will be, scanned out */
+	if (drm->queued_post)
+		last = drm->queued_post;
+	else if (drm->next_front)
+		last = drm->next_front;
+	else
+		last = drm->current_front;
+
+	switch (drm->swap_mode) {
+	case DRM_SWAP_FLIP:
+		return (bo == last && !gralloc_drm_planes_changed(drm, drm->primary));
+	case DRM_SWAP_SETCRTC:
+		return (bo == last && !gralloc_drm_planes_changed(drm, drm->primary));
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Post a bo in copy mode with a ring of fronts.  bo is copied to a front
+ * that is not scanned out, without waiting for a vblank, and the front is
+ * then flipped to.
+ */
+static int drm_kms_copy_post(struct gralloc_drm_t *drm,
+		struct gralloc_drm_bo_t *bo,
+		const drmModeClip *damage, int damage_count)
+{
+	struct gralloc_drm_bo_t *back;
+	int ret;
+
+	back = drm_kms_copy_back(drm);
+	if (!back) {
+		/* every front is busy, let the pending one land */
+		drm_kms_page_flip(drm, NULL);
+		back = drm_kms_copy_back(drm);
+		if (!back)
+			return -EBUSY;
+	}
+
+	drm_kms_copy_blit(drm, back, bo, damage, damage_count);
+
+	/*
+	 * wait for the previous flip before scheduling another; without
+	 * flips the crtc is set on a vblank, as it would tear mid-frame
+	 */
+	drm_kms_page_flip(drm, NULL);
+	if ((drm->mode_page_flip &&
+	     (drm->swap_interval <= 1 || drm->primary->vrr)) ||
+	    drm_kms_queue_post(drm, back, drm->mode_page_flip))
+		ret = drm_kms_copy_show(drm, back);
+	else
+		ret = 0;
+
+	/* the fronts are not written by CPU */
+	if (drm->mode_sync_flip && (drm->next_front || drm->vblank_pending))
+		drm_kms_page_flip(drm, NULL);
+
+	return ret;
+}
+
+static int drm_kms_post(struct gralloc_drm_bo_t *bo,
+		const drmModeClip *damage, int damage_count)
+{
+	struct gralloc_drm_t *drm = bo->drm;
+	int ret;
+
+	/* the displays have been given back */
+	if (drm->shutdown)
+		return -ENODEV;
+
+	if (!bo->fb_id && drm->swap_mode != DRM_SWAP_COPY) {
+		ALOGE("unable to post bo %p without fb", bo);
+		return -EINVAL;
+	}
+
+	if (drm->first_post) {
+		/* let the queued post, if any, land before the modeset */
+		if (drm->vblank_pending)
+			drm_kms_page_flip(drm, NULL);
+
+		/* the crtc is lit at the mode, replace its fb by a flip */
+		if (drm->primary->adopted) {
+			drm->primary->adopted = 0;
+
+			/* the flip queues the frame for the hdmi modeset */
+			pthread_mutex_lock(&drm->clone_mutex);
+			drm->clone_modeset = 1;
+			pthread_mutex_unlock(&drm->clone_mutex);
+
+			ret = drm_kms_page_flip(drm, bo);
+			if (!ret) {
+				/* there is no front of ours to keep until then */
+				drm_kms_page_flip(drm, NULL);
+				drm->first_post = 0;
+				return 0;
+			}
+			ALOGI("failed to take over the crtc, doing a modeset");
+		}
+
+		/* a modeset may have changed the planes behind our back */
+		if (drm->planes) {
+			unsigned int i;
+			for (i = 0; i < drm->plane_resources->count_planes; i++)
+				drm->planes[i].committed = 0;
+		}
+
+		if (drm->swap_mode == DRM_SWAP_COPY) {
+			struct gralloc_drm_bo_t *dst;
+			drmModeClip full;
+
+			dst = (drm->next_front) ?
+				drm->next_front :
+				drm->current_front;
+			drm_kms_clip_damage(bo, NULL, 0, &full);
+			drm_kms_copy_blit(drm, dst, bo, &full, 1);
+			bo = dst;
+		}
+
+		if (drm->scaler) {
+			ret = drm_kms_set_crtc(drm, drm->primary,
+					drm->primary->bo->fb_id);
+			if (!ret)
+				ret = drm_kms_scale_post(drm, bo);
+		}
+		else {
+			ret = drm_kms_set_crtc(drm, drm->primary, bo->fb_id);
+		}
+		if (!ret) {
+			drm->first_post = 0;
+			drm->current_front = bo;
+			if (drm->next_front == bo)
+				drm->next_front = NULL;
+			gralloc_drm_set_planes(drm, drm->primary);
+		}
+
+		drm_kms_clone_queue(drm, bo, 1);
+
+		return ret;
+	}
+
+	if (drm->drs.enabled)
+		drm_kms_drs_post(drm);
+
+	if (drm_kms_post_is_repeat(drm, bo)) {
+		drm->elided_posts++;
+		ALOGV("bo %p is already on screen, %u posts elided",
+				bo, drm->elided_posts);
+
+		/* no hardware update, but keep the pace of a real post */
+		drm_kms_page_flip(drm, NULL);
+		if (!drm->primary->vrr &&
+		    !drm_kms_queue_post(drm, NULL, 0) && drm->mode_sync_flip)
+			drm_kms_page_flip(drm, NULL);
+
+		return 0;
+	}
+
+	switch (drm->swap_mode) {
+	case DRM_SWAP_FLIP:
+		/*
+		 * wait for the previous flip before scheduling another; with
+		 * variable refresh the panel waits for the frame instead
+		 */
+		drm_kms_page_flip(drm, NULL);
+		if (drm->swap_interval <= 1 || drm->primary->vrr ||
+		    drm_kms_queue_post(drm, bo, 1))
+			ret = drm_kms_page_flip(drm, bo);
+		else
+			ret = 0;
+		if (drm->next_front || drm->vblank_pending) {
+			/*
+			 * wait if the driver says so or the current front
+			 * will be written by CPU
+			 */
+			if (drm->mode_sync_flip ||
+			    (drm->current_front->handle->usage &
+			     GRALLOC_USAGE_SW_WRITE_MASK))
+				drm_kms_page_flip(drm, NULL);
+		}
+		break;
+	case DRM_SWAP_COPY:
+		if (drm->copy_front_count > 1) {
+			ret = drm_kms_copy_post(drm, bo, damage, damage_count);
+			break;
+		}
+
+		/*
+		 * the blit happens on the vblank and reads only from bo, which
+		 * is not scanned out, so there is no need to wait for it
+		 */
+		drm_kms_page_flip(drm, NULL);
+		memcpy(drm->queued_damage, damage,
+				sizeof(*damage) * damage_count);
+		drm->queued_damage_count = damage_count;
+		if (drm_kms_queue_post(drm, bo, 0))
+			ret = drm_kms_commit_post(drm, bo,
+					damage, damage_count);
+		else
+			ret = 0;
+		break;
+	case DRM_SWAP_SETCRTC:
+		drm_kms_page_flip(drm, NULL);
+		if (drm_kms_queue_post(drm, bo, 0)) {
+			ret = drm_kms_commit_post(drm, bo, NULL, 0);
+		}
+		else {
+			ret = 0;
+			/* the current front is still scanned out until then */
+			if (drm->mode_sync_flip ||
+			    (drm->current_front->handle->usage &
+			     GRALLOC_USAGE_SW_WRITE_MASK))
+				drm_kms_page_flip(drm, NULL);
+		}
+		break;
+	default:
+		/* no-op */
+		ret = 0;
+		break;
+	}
+
+	return ret;
+}
+
+/*
+ * Post a bo, of which only the count rectangles in rects have changed since
+ * the previous post.  rects may be NULL when all of bo has changed.  Posts
+ * are serialized by event_mutex.
+ */
+int gralloc_drm_bo_post_damage(struct gralloc_drm_bo_t *bo,
+		const struct drm_clip_rect *rects, int count)
+{
+	struct gralloc_drm_t *drm = bo->drm;
+	drmModeClip damage[GRALLOC_DRM_MAX_DAMAGE];
+	int damage_count, ret;
+
+	damage_count = drm_kms_clip_damage(bo, rects, count, damage);
+
+	/* the event thread may be carrying out a queued post */
+	pthread_mutex_lock(&drm->event_mutex);
+	ret = drm_kms_post(bo, damage, damage_count);
+	pthread_mutex_unlock(&drm->event_mutex);
+
+	return ret;
+}
+
+/*
+ * Post a bo.
+ */
+int gralloc_drm_bo_post(struct gralloc_drm_bo_t *bo)
+{
+	return gralloc_drm_bo_post_damage(bo, NULL, 0);
+}
+
+/*
+ * Interface for HWC, used to post a buffer to the primary display with the
+ * damage from the previous frame.
+ */
+int gralloc_drm_post_damage(struct gralloc_drm_t *drm,
+	buffer_handle_t handle, const struct drm_clip_rect *rects, int count)
+{
+	struct gralloc_drm_bo_t *bo;
+
+	bo = gralloc_drm_bo_from_handle(handle);
+	if (!bo || bo->drm != drm)
+		return -EINVAL;
+
+	return gralloc_drm_bo_post_damage(bo, rects, count);
+}
+
+/*
+ * Post a bo to the swapchain of an extended output.  Only flips of that
+ * output are waited for.  The caller must hold event_mutex.
+ */
+static int drm_kms_post_extended(struct gralloc_drm_t *drm, int disp,
+		struct gralloc_drm_bo_t *bo)
+{
+	struct gralloc_drm_output *output;
+	int ret;
+
+	if (disp <= 0 || disp >= drm->output_count)
+		return -EINVAL;
+	output = &drm->outputs[disp];
+
+	if (drm->shutdown)
+		return -ENODEV;
+
+	while (output->next_front) {
+		ret = drm_kms_handle_events(drm, 1000);
+		if (ret <= 0) {
+			/* record an error and break */
+			ALOGE("no event for the pending flip of display %d", disp);
+			output->current_front = output->next_front;
+			output->next_front = NULL;
+		}
+	}
+
+	pthread_mutex_lock(&drm->hdmi_mutex);
+
+	if (!output->active || !drm_kms_output_extended(drm, output)) {
+		pthread_mutex_unlock(&drm->hdmi_mutex);
+		return -ENODEV;
+	}
+
+	/* there are no fbs in copy mode, but the output scans out the bo as is */
+	if (!bo->fb_id && gralloc_drm_bo_add_fb(bo)) {
+		ALOGE("failed to add fb for display %d", disp);
+		pthread_mutex_unlock(&drm->hdmi_mutex);
+		return -EINVAL;
+	}
+
+	if (output->first_post || drm->swap_mode != DRM_SWAP_FLIP) {
+		ret = drm_kms_set_crtc(drm, output, bo->fb_id);
+		if (!ret) {
+			output->first_post = 0;
+			output->current_front = bo;
+		}
+	}
+	else {
+		ret = drmModePageFlip(drm->fd, output->crtc_id, bo->fb_id,
+				DRM_MODE_PAGE_FLIP_EVENT, (void *) output);
+		if (ret) {
+			ALOGE("failed to perform page flip for display %d (%s) (crtc %d fb %d))",
+				disp, strerror(errno), output->crtc_id, bo->fb_id);
+			/* try to set mode for next frame */
+			if (errno != EBUSY)
+				output->first_post = 1;
+		}
+		else {
+			output->next_front = bo;
+		}
+	}
+
+	/* the planes hwc reserved on this display */
+	if (!ret)
+		gralloc_drm_set_planes(drm, output);
+
+	pthread_mutex_unlock(&drm->hdmi_mutex);
+
+	return ret;
+}
+
+/*
+ * Post a bo to an extended output.  Posts are serialized by event_mutex.
+ */
+int gralloc_drm_bo_post_display(struct gralloc_drm_bo_t *bo, int disp)
+{
+	struct gralloc_drm_t *drm = bo->drm;
+	int ret;
+
+	pthread_mutex_lock(&drm->event_mutex);
+	ret = drm_kms_post_extended(drm, disp, bo);
+	pthread_mutex_unlock(&drm->event_mutex);
+
+	return ret;
+}
+
+/*
+ * Return true if two modes have the same timings.
+ */
+static int drm_kms_mode_equal(const drmModeModeInfo *a,
+		const drmModeModeInfo *b)
+{
+	return (a->clock == b->clock &&
+		a->hdisplay == b->hdisplay && a->vdisplay == b->vdisplay &&
+		a->htotal == b->htotal && a->vtotal == b->vtotal &&
+		a->hsync_start == b->hsync_start &&
+		a->hsync_end == b->hsync_end &&
+		a->vsync_start == b->vsync_start &&
+		a->vsync_end == b->vsync_end &&
+		a->flags == b->flags);
+}
+
+/*
+ * Return the connector of an output, or NULL.  The caller must hold
+ * hdmi_mutex.
+ */
+static drmModeConnectorPtr drm_kms_output_connector(struct gralloc_drm_t *drm,
+		const struct gralloc_drm_output *output)
+{
+	int i;
+
+	for (i = 0; drm->connectors && i < drm->resources->count_connectors; i++) {
+		drmModeConnectorPtr connector = drm->connectors[i];
+
+		if (connector && connector->connector_id == output->connector_id)
+			return connector;
+	}
+
+	return NULL;
+}
+
+/*
+ * Return true if a mode has the resolution of an output's current mode.
+ */
+static int drm_kms_mode_same_size(const drmModeModeInfo *m,
+		const struct gralloc_drm_output *output)
+{
+	return (m->hdisplay == output->mode.hdisplay &&
+		m->vdisplay == output->mode.vdisplay &&
+		(m->flags & DRM_MODE_FLAG_INTERLACE) ==
+		(output->mode.flags & DRM_MODE_FLAG_INTERLACE));
+}
+
+/*
+ * Find the mode of an output's connector with the resolution of the
+ * current mode and a refresh rate in mHz.  The caller must hold hdmi_mutex.
+ */
+static const drmModeModeInfo *drm_kms_find_refresh_mode(
+		struct gralloc_drm_t *drm,
+		const struct gralloc_drm_output *output, int rate)
+{
+	drmModeConnectorPtr connector = drm_kms_output_connector(drm, output);
+	int j;
+
+	for (j = 0; connector && j < connector->count_modes; j++) {
+		const drmModeModeInfo *m = &connector->modes[j];
+
+		if (drm_kms_mode_same_size(m, output) &&
+		    drm_kms_mode_mhz(m) == rate)
+			return m;
+	}
+
+	return NULL;
+}
+
+/*
+ * Interface for HWC, used to list the refresh rates a display can switch
+ * to at its resolution, in mHz.  Return how many there are; at most count
+ * are stored.
+ */
+int gralloc_drm_get_refresh_rates(struct gralloc_drm_t *drm, int disp,
+		int *rates, int count)
+{
+	struct gralloc_drm_output *output;
+	drmModeConnectorPtr connector;
+	int n = 0, j, k;
+
+	pthread_mutex_lock(&drm->hdmi_mutex);
+
+	output = drm_kms_get_output(drm, disp);
+	if (!output) {
+		pthread_mutex_unlock(&drm->hdmi_mutex);
+		return -EINVAL;
+	}
+
+	connector = drm_kms_output_connector(drm, output);
+	for (j = 0; connector && j < connector->count_modes; j++) {
+		const drmModeModeInfo *m = &connector->modes[j];
+		int rate = drm_kms_mode_mhz(m);
+
+		if (!drm_kms_mode_same_size(m, output))
+			continue;
+
+		/* modes differing in other timings have the same rate */
+		for (k = 0; k < j; k++) {
+			if (drm_kms_mode_same_size(&connector->modes[k], output) &&
+			    drm_kms_mode_mhz(&connector->modes[k]) == rate)
+				break;
+		}
+		if (k < j)
+			continue;
+
+		if (n < count)
+			rates[n] = rate;
+		n++;
+	}
+
+	pthread_mutex_unlock(&drm->hdmi_mutex);
+
+	return n;
+}
+
+/*
+ * Interface for HWC, used to switch a display to another refresh rate at
+ * the same resolution, such as 23.976, 24, 25 or 50 Hz for video.  The
+ * rate is in mHz, as listed by gralloc_drm_get_refresh_rates.  The
+ * swapchain is kept: its front is shown again at the new rate.
+ */
+int gralloc_drm_set_refresh_rate(struct gralloc_drm_t *drm, int disp,
+		int rate)
+{
+	struct gralloc_drm_output *output;
+	const drmModeModeInfo *mode;
+	struct gralloc_drm_bo_t *front;
+	int ret = 0;
+
+	/* no post in the middle */
+	pthread_mutex_lock(&drm->event_mutex);
+	pthread_mutex_lock(&drm->hdmi_mutex);
+
+	output = drm_kms_get_output(drm, disp);
+	mode = (output) ? drm_kms_find_refresh_mode(drm, output, rate) : NULL;
+	if (!mode) {
+		pthread_mutex_unlock(&drm->hdmi_mutex);
+		pthread_mutex_unlock(&drm->event_mutex);
+		return -EINVAL;
+	}
+	if (drm_kms_mode_equal(mode, &output->mode)) {
+		pthread_mutex_unlock(&drm->hdmi_mutex);
+		pthread_mutex_unlock(&drm->event_mutex);
+		return 0;
+	}
+
+	ALOGI("display %d switches to %s@%d.%03d", disp, mode->name,
+		rate / 1000, rate % 1000);
+
+	/* let the pending flips land on the old mode */
+	if (output == drm->primary) {
+		drm_kms_page_flip(drm, NULL);
+	}
+	else {
+		while (output->next_front) {
+			if (drm_kms_handle_events(drm, 1000) <= 0) {
+				output->current_front = output->next_front;
+				output->next_front = NULL;
+			}
+		}
+	}
+
+	output->mode = *mode;
+
+	pthread_mutex_lock(&drm->vsync_mutex);
+	drm_kms_vsync_reset(&output->vsync, &output->mode);
+	pthread_mutex_unlock(&drm->vsync_mutex);
+
+	/* the fetch rate of planes has changed */
+	drm_kms_plane_check_flush(drm);
+
+	if (output == drm->primary) {
+		front = drm->current_front;
+		if (!front) {
+			drm->first_post = 1;
+		}
+		else if (drm->scaler) {
+			ret = drm_kms_set_crtc(drm, output, output->bo->fb_id);
+			if (!ret)
+				ret = drm_kms_scale_post(drm, front);
+		}
+		else {
+			ret = drm_kms_set_crtc(drm, output, front->fb_id);
+		}
+		if (ret)
+			drm->first_post = 1;
+	}
+	else if (drm_kms_output_extended(drm, output)) {
+		front = output->current_front;
+		if (!front || drm_kms_set_crtc(drm, output, front->fb_id))
+			output->first_post = 1;
+	}
+
+	pthread_mutex_unlock(&drm->hdmi_mutex);
+
+	/* a clone is set again, and may no longer share the primary fb */
+	if (output == drm->primary || output == drm->hdmi) {
+		pthread_mutex_lock(&drm->clone_mutex);
+		drm->clone_modeset = 1;
+		pthread_mutex_unlock(&drm->clone_mutex);
+		if (drm->current_front)
+			drm_kms_clone_queue(drm, drm->current_front, 1);
+	}
+
+	pthread_mutex_unlock(&drm->event_mutex);
 
 	return ret;
 }
 
+/* write end of the shutdown pipe, for the signal handler */
+static int drm_kms_shutdown_fd = -1;
+
+/*
+ * Handler of SIGINT and SIGTERM.  The GPU tends to freeze if the process
+ * dies with a flip pending, so the signal is passed to whoever dispatches
+ * the display events, to shut the displays down and raise it again.  Only
+ * async-signal-safe calls are made here.
+ */
+static void on_signal(int sig)
+{
+	unsigned char c = sig;
+
+	if (drm_kms_shutdown_fd < 0 ||
+	    write(drm_kms_shutdown_fd, &c, 1) != 1) {
+		signal(sig, SIG_DFL);
+		raise(sig);
+	}
+}
+
+/*
+ * Create the shutdown pipe and handle SIGINT and SIGTERM, unless the
+ * process handles them itself.
+ */
+static void drm_kms_init_signals(struct gralloc_drm_t *drm)
+{
+	static const int sigs[] = { SIGINT, SIGTERM };
+	unsigned int i;
+
+	if (pipe(drm->shutdown_pipe)) {
+		ALOGE("failed to create shutdown pipe");
+		drm->shutdown_pipe[0] = drm->shutdown_pipe[1] = -1;
+		return;
+	}
+	fcntl(drm->shutdown_pipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(drm->shutdown_pipe[1], F_SETFL, O_NONBLOCK);
+
+	drm_kms_shutdown_fd = drm->shutdown_pipe[1];
+
+	for (i = 0; i < sizeof(sigs) / sizeof(sigs[0]); i++) {
+		struct sigaction act;
+
+		if (sigaction(sigs[i], NULL, &act) ||
+		    act.sa_handler != SIG_DFL)
+			continue;
+
+		sigemptyset(&act.sa_mask);
+		act.sa_handler = on_signal;
+		act.sa_flags = 0;
+		sigaction(sigs[i], &act, NULL);
+	}
+}
+
+/*
+ * Set up rendering at the size given by debug.drm.render.size, as in
+ * "1280x720", scaled up to the primary mode by an overlay plane.  With
+ * debug.drm.render.min, the render size also adjusts to the frame rate
+ * between the two.  Return 0 when scaling is set up.
+ */
+static int drm_kms_init_scaler(struct gralloc_drm_t *drm)
+{
+	struct gralloc_drm_output *output = drm->primary;
+	char value[PROPERTY_VALUE_MAX];
+	struct gralloc_drm_drs_t *drs = &drm->drs;
+	struct gralloc_drm_bo_t *bg;
+	unsigned int width, height;
+
+	width = output->mode.hdisplay;
+	height = output->mode.vdisplay;
+	if (property_get("debug.drm.render.size", value, NULL) &&
+	    sscanf(value, "%ux%u", &width, &height) != 2)
+		return -EINVAL;
+
+	if (!width || !height ||
+	    width > output->mode.hdisplay || height > output->mode.vdisplay)
+		return -EINVAL;
+
+	/* the lower bound of dynamic resolution */
+	memset(drs, 0, sizeof(*drs));
+	if (property_get("debug.drm.render.min", value, NULL) &&
+	    sscanf(value, "%ux%u", &drs->min_width, &drs->min_height) == 2 &&
+	    drs->min_width && drs->min_height &&
+	    (drs->min_width < width || drs->min_height < height)) {
+		drs->enabled = 1;
+		if (drs->min_width > width)
+			drs->min_width = width;
+		if (drs->min_height > height)
+			drs->min_height = height;
+	}
+
+	/* nothing to scale */
+	if (width == output->mode.hdisplay &&
+	    height == output->mode.vdisplay && !drs->enabled)
+		return -EINVAL;
+
+	if (drm->swap_mode == DRM_SWAP_NOOP || drm->mode_quirk_vmwgfx)
+		return -EINVAL;
+
+	/* a free overlay on the primary pipe that takes the fb format */
+	drm->scaler = drm_kms_find_free_plane(drm, output, output->fb_format);
+	if (!drm->scaler) {
+		ALOGW("no plane to scale %ux%u to the mode", width, height);
+		return -EINVAL;
+	}
+
+	/* what the crtc shows around the scaled swapchain */
+	bg = gralloc_drm_bo_create(drm,
+			output->mode.hdisplay, output->mode.vdisplay,
+			output->fb_format, GRALLOC_USAGE_HW_FB);
+	if (bg && gralloc_drm_bo_add_fb(bg)) {
+		gralloc_drm_bo_decref(bg);
+		bg = NULL;
+	}
+	if (bg)
+		drm_kms_clear_bo(bg);
+	if (!bg) {
+		drm->scaler = NULL;
+		return -ENOMEM;
+	}
+
+	output->bo = bg;
+	drm->scaler->reserved = 1;
+	drm->render_width = width;
+	drm->render_height = height;
+
+	drs->max_width = width;
+	drs->max_height = height;
+	drs->width = width;
+	drs->height = height;
+	drs->scale = DRS_SCALE_ONE;
+	if (drs->enabled)
+		ALOGI("render size adjusts down to %ux%u",
+			drs->min_width, drs->min_height);
+
+	ALOGI("rendering at %ux%u, scaled to %dx%d by plane %d",
+		width, height, output->mode.hdisplay, output->mode.vdisplay,
+		drm->scaler->drm_plane->plane_id);
+
+	return 0;
+}
+
+static const char *drm_kms_swap_mode_names[] = {
+	[DRM_SWAP_NOOP] = "no-op",
+	[DRM_SWAP_FLIP] = "flip",
+	[DRM_SWAP_COPY] = "copy",
+	[DRM_SWAP_SETCRTC] = "set-crtc",
+};
+
+/* rounds of each way of posting timed by the calibration */
+#define CALIBRATE_ROUNDS 8
+
+static unsigned int drm_kms_calibrate_flips;
+
+/*
+ * Callback for a page flip of the calibration.  user_data is the primary
+ * output, so that a flip landing after the calibration gave up on it is
+ * harmless to page_flip_handler.
+ */
+static void drm_kms_calibrate_flip_handler(int fd, unsigned int sequence,
+		unsigned int tv_sec, unsigned int tv_usec,
+		void *user_data)
+{
+	drm_kms_calibrate_flips++;
+}
+
 /*
- * Wait for the next post.
+ * Time the ways of posting on the primary output, with two black fbs: the
+ * latency of a flip, a full copy until it is idle, and a crtc set.  Return
+ * the best swap mode, or DRM_SWAP_NOOP if the output could not be lit.
  */
-static void drm_kms_wait_for_post(struct gralloc_drm_t *drm, int flip)
+static enum drm_swap_mode drm_kms_calibrate(struct gralloc_drm_t *drm)
 {
-	unsigned int current, target;
-	drmVBlank vbl;
-	int ret;
+	struct gralloc_drm_output *output = drm->primary;
+	struct gralloc_drm_bo_t *bos[2] = { NULL, NULL };
+	enum drm_swap_mode mode = DRM_SWAP_NOOP;
+	int64_t period, start, flip_ns = 0, copy_ns = 0, setcrtc_ns = 0;
+	drmEventContext evctx;
+	int i, flips = 0;
+
+	for (i = 0; i < 2; i++) {
+		bos[i] = gralloc_drm_bo_create(drm,
+				output->mode.hdisplay, output->mode.vdisplay,
+				output->fb_format, GRALLOC_USAGE_HW_FB);
+		if (bos[i] && gralloc_drm_bo_add_fb(bos[i])) {
+			gralloc_drm_bo_decref(bos[i]);
+			bos[i] = NULL;
+		}
+		if (!bos[i])
+			goto out;
+		drm_kms_clear_bo(bos[i]);
+	}
 
-	if (drm->mode_quirk_vmwgfx)
-		return;
+	/* set-crtc, which also lights the output for the flips */
+	for (i = 0; i < CALIBRATE_ROUNDS; i++) {
+		start = drm_kms_now(drm);
+		if (drm_kms_set_crtc(drm, output, bos[i & 1]->fb_id))
+			goto out;
+		setcrtc_ns += drm_kms_now(drm) - start;
+	}
+	setcrtc_ns /= CALIBRATE_ROUNDS;
 
-	flip = !!flip;
+	memset(&evctx, 0, sizeof(evctx));
+	evctx.version = DRM_EVENT_CONTEXT_VERSION;
+	evctx.page_flip_handler = drm_kms_calibrate_flip_handler;
 
-	memset(&vbl, 0, sizeof(vbl));
-	vbl.request.type = DRM_VBLANK_RELATIVE;
-	if (drm->vblank_secondary)
-		vbl.request.type |= DRM_VBLANK_SECONDARY;
-	vbl.request.sequence = 0;
+	for (i = 0; i < CALIBRATE_ROUNDS; i++) {
+		struct pollfd pfd;
+		int ret;
 
-	/* get the current vblank */
-	ret = drmWaitVBlank(drm->fd, &vbl);
-	if (ret) {
-		ALOGW("failed to get vblank");
-		return;
+		start = drm_kms_now(drm);
+		drm_kms_calibrate_flips = 0;
+		if (drmModePageFlip(drm->fd, output->crtc_id,
+				bos[i & 1]->fb_id, DRM_MODE_PAGE_FLIP_EVENT,
+				(void *) output))
+			break;
+
+		pfd.fd = drm->fd;
+		pfd.events = POLLIN;
+		while (!drm_kms_calibrate_flips) {
+			pfd.revents = 0;
+			do {
+				ret = poll(&pfd, 1, 1000);
+			} while (ret < 0 && errno == EINTR);
+			if (ret <= 0 || drmHandleEvent(drm->fd, &evctx))
+				break;
+		}
+		if (!drm_kms_calibrate_flips)
+			break;
+
+		flip_ns += drm_kms_now(drm) - start;
+		flips++;
+	}
+	if (flips)
+		flip_ns /= flips;
+
+	if (drm->drv->blit) {
+		for (i = 0; i < CALIBRATE_ROUNDS; i++) {
+			void *addr;
+
+			start = drm_kms_now(drm);
+			gralloc_drm_bo_blit(bos[0], bos[1],
+					0, 0, output->mode.hdisplay,
+					output->mode.vdisplay,
+					0, 0, output->mode.hdisplay,
+					output->mode.vdisplay);
+			/* the mapping waits for the copy */
+			if (!gralloc_drm_bo_lock(bos[0],
+					GRALLOC_USAGE_SW_READ_OFTEN, 0, 0,
+					1, 1, &addr))
+				gralloc_drm_bo_unlock(bos[0]);
+			copy_ns += drm_kms_now(drm) - start;
+		}
+		copy_ns /= CALIBRATE_ROUNDS;
 	}
 
-	current = vbl.reply.sequence;
-	if (drm->first_post)
-		target = current;
+	period = NSEC_PER_SEC / ((output->mode.vrefresh) ?
+			output->mode.vrefresh : 60);
+
+	/*
+	 * flips cost no copy and do not tear, when they land in time; a copy
+	 * has to be done well before scanout reaches the front
+	 */
+	if (flips == CALIBRATE_ROUNDS && flip_ns <= 2 * period)
+		mode = DRM_SWAP_FLIP;
+	else if (drm->drv->blit && copy_ns <= period / 2 &&
+		 copy_ns <= setcrtc_ns)
+		mode = DRM_SWAP_COPY;
 	else
-		target = drm->last_swap + drm->swap_interval - flip;
+		mode = DRM_SWAP_SETCRTC;
 
-	/* wait for vblank */
-	if (current < target || !flip) {
-		memset(&vbl, 0, sizeof(vbl));
-		vbl.request.type = DRM_VBLANK_ABSOLUTE;
-		if (drm->vblank_secondary)
-			vbl.request.type |= DRM_VBLANK_SECONDARY;
-		if (!flip) {
-			vbl.request.type |= DRM_VBLANK_NEXTONMISS;
-			if (target < current)
-				target = current;
-		}
+	ALOGI("calibrated swap mode %s: flip %lld us (%d/%d landed), copy %lld us, set-crtc %lld us",
+		drm_kms_swap_mode_names[mode],
+		(long long) flip_ns / 1000, flips, CALIBRATE_ROUNDS,
+		(long long) copy_ns / 1000, (long long) setcrtc_ns / 1000);
 
-		vbl.request.sequence = target;
+out:
+	/* the output goes dark with the fbs, until the first post */
+	for (i = 0; i < 2; i++)
+		if (bos[i])
+			gralloc_drm_bo_decref(bos[i]);
 
-		ret = drmWaitVBlank(drm->fd, &vbl);
-		if (ret) {
-			ALOGW("failed to wait vblank");
-			return;
-		}
+	return mode;
+}
+
+/*
+ * Read an id from a sysfs file of the device.
+ */
+static unsigned int drm_kms_read_device_id(const struct stat *st,
+		const char *name)
+{
+	char path[64];
+	unsigned int id = 0;
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "/sys/dev/char/%u:%u/device/%s",
+			major(st->st_rdev), minor(st->st_rdev), name);
+	fp = fopen(path, "r");
+	if (fp) {
+		if (fscanf(fp, "%x", &id) != 1)
+			id = 0;
+		fclose(fp);
 	}
 
-	drm->last_swap = vbl.reply.sequence + flip;
+	return id;
 }
 
 /*
- * Post a bo.  This is not thread-safe.
+ * Choose the swap mode by calibration, unless a calibration of the same
+ * device on the same kernel is in the cache file.  Each line of the file is
+ * "<vendor>:<device> <kernel release> <swap mode>".
  */
-int gralloc_drm_bo_post(struct gralloc_drm_bo_t *bo)
+static void drm_kms_init_swap_mode(struct gralloc_drm_t *drm)
 {
-	struct gralloc_drm_t *drm = bo->drm;
-	int ret;
+	char path[PROPERTY_VALUE_MAX], key[128], line[256];
+	char line_id[32], line_release[96], line_mode[16];
+	enum drm_swap_mode mode = DRM_SWAP_NOOP;
+	struct utsname uts;
+	struct stat st;
+	FILE *fp;
+	int i;
 
-	if (!bo->fb_id && drm->swap_mode != DRM_SWAP_COPY) {
-		ALOGE("unable to post bo %p without fb", bo);
-		return -EINVAL;
+	if (fstat(drm->fd, &st) || uname(&uts)) {
+		ALOGE("failed to identify the device for calibration (%s)",
+			strerror(errno));
+		return;
 	}
+	snprintf(key, sizeof(key), "%04x:%04x %s",
+		drm_kms_read_device_id(&st, "vendor"),
+		drm_kms_read_device_id(&st, "device"), uts.release);
 
-	/* TODO spawn a thread to avoid waiting and race */
-
-	if (drm->first_post) {
-		if (drm->swap_mode == DRM_SWAP_COPY) {
-			struct gralloc_drm_bo_t *dst;
-
-			dst = (drm->next_front) ?
-				drm->next_front :
-				drm->current_front;
-			drm->drv->blit(drm->drv, dst, bo, 0, 0,
-					bo->handle->width,
-					bo->handle->height,
-					0, 0,
-					bo->handle->width,
-					bo->handle->height);
-			bo = dst;
-		}
+	property_get("debug.drm.swap.cache", path,
+			"/data/system/gralloc.drm.swap");
 
-		ret = drm_kms_set_crtc(drm, &drm->primary, bo->fb_id);
-		if (!ret) {
-			drm->first_post = 0;
-			drm->current_front = bo;
-			if (drm->next_front == bo)
-				drm->next_front = NULL;
-		}
+	fp = fopen(path, "r");
+	while (fp && fgets(line, sizeof(line), fp)) {
+		char line_key[128];
 
-		pthread_mutex_lock(&drm->hdmi_mutex);
-		if (drm->hdmi.active && drm->hdmi_mode == HDMI_CLONED && drm->hdmi.bo)
-			drm_kms_set_crtc(drm, &drm->hdmi, drm->hdmi.bo->fb_id);
-		pthread_mutex_unlock(&drm->hdmi_mutex);
+		if (sscanf(line, "%31s %95s %15s",
+				line_id, line_release, line_mode) != 3)
+			continue;
+		snprintf(line_key, sizeof(line_key), "%s %s",
+				line_id, line_release);
+		if (strcmp(line_key, key))
+			continue;
 
-		return ret;
+		for (i = DRM_SWAP_FLIP; i <= DRM_SWAP_SETCRTC; i++)
+			if (!strcmp(line_mode, drm_kms_swap_mode_names[i]))
+				mode = (enum drm_swap_mode) i;
 	}
+	if (fp)
+		fclose(fp);
 
-	switch (drm->swap_mode) {
-	case DRM_SWAP_FLIP:
-		if (drm->swap_interval > 1)
-			drm_kms_wait_for_post(drm, 1);
-		ret = drm_kms_page_flip(drm, bo);
-		if (drm->next_front) {
-			/*
-			 * wait if the driver says so or the current front
-			 * will be written by CPU
-			 */
-			if (drm->mode_sync_flip ||
-			    (drm->current_front->handle->usage &
-			     GRALLOC_USAGE_SW_WRITE_MASK))
-				drm_kms_page_flip(drm, NULL);
-		}
-		break;
-	case DRM_SWAP_COPY:
-		drm_kms_wait_for_post(drm, 0);
-		drm->drv->blit(drm->drv, drm->current_front,
-				bo, 0, 0,
-				bo->handle->width,
-				bo->handle->height,
-				0, 0,
-				bo->handle->width,
-				bo->handle->height);
-		if (drm->mode_quirk_vmwgfx)
-			ret = drmModeDirtyFB(drm->fd, drm->current_front->fb_id, &drm->clip, 1);
-		ret = 0;
-		break;
-	case DRM_SWAP_SETCRTC:
-		drm_kms_wait_for_post(drm, 0);
-		ret = drm_kms_set_crtc(drm, &drm->primary, bo->fb_id);
-
-		pthread_mutex_lock(&drm->hdmi_mutex);
-		if (drm->hdmi.active && drm->hdmi_mode == HDMI_CLONED && drm->hdmi.bo)
-			drm_kms_set_crtc(drm, &drm->hdmi, drm->hdmi.bo->fb_id);
-		pthread_mutex_unlock(&drm->hdmi_mutex);
+	if (mode == DRM_SWAP_COPY && !drm->drv->blit)
+		mode = DRM_SWAP_NOOP;
 
-		drm->current_front = bo;
-		break;
-	default:
-		/* no-op */
-		ret = 0;
-		break;
+	if (mode != DRM_SWAP_NOOP) {
+		ALOGD("swap mode %s of %s is cached",
+			drm_kms_swap_mode_names[mode], key);
+		drm->swap_mode = mode;
+		return;
 	}
 
-	return ret;
-}
-
-static struct gralloc_drm_t *drm_singleton;
-
-static void on_signal(int sig)
-{
-	struct gralloc_drm_t *drm = drm_singleton;
-
-	/* wait the pending flip */
-	if (drm && drm->swap_mode == DRM_SWAP_FLIP && drm->next_front) {
-		/* there is race, but this function is hacky enough to ignore that */
-		if (drm_singleton->waiting_flip)
-			usleep(100 * 1000); /* 100ms */
-		else
-			drm_kms_page_flip(drm_singleton, NULL);
+	mode = drm_kms_calibrate(drm);
+	if (mode == DRM_SWAP_NOOP) {
+		ALOGE("failed to calibrate the swap mode");
+		return;
 	}
+	drm->swap_mode = mode;
 
-	exit(-1);
+	/* the cache is for this device only */
+	fp = fopen(path, "w");
+	if (fp) {
+		fprintf(fp, "%s %s\n", key, drm_kms_swap_mode_names[mode]);
+		fclose(fp);
+	}
+	else {
+		ALOGE("failed to write %s (%s)", path, strerror(errno));
+	}
 }
 
 static void drm_kms_init_features(struct gralloc_drm_t *drm)
 {
-	const char *swap_mode;
+	char value[PROPERTY_VALUE_MAX];
 
 	/* call to the driver here, after KMS has been initialized */
 	drm->drv->init_kms_features(drm->drv, drm);
 
-	if (drm->swap_mode == DRM_SWAP_FLIP) {
-		struct sigaction act;
+	drm->render_width = drm->primary->mode.hdisplay;
+	drm->render_height = drm->primary->mode.vdisplay;
+
+	/* optionally measure what the driver guessed from its capabilities */
+	property_get("debug.drm.swap.calibrate", value, "0");
+	if (atoi(value) && drm->swap_mode != DRM_SWAP_NOOP &&
+	    !drm->mode_quirk_vmwgfx)
+		drm_kms_init_swap_mode(drm);
+
+	/* the scaler plane is updated like a crtc, with no flips or copies */
+	if (!drm_kms_init_scaler(drm) && drm->swap_mode != DRM_SWAP_SETCRTC) {
+		ALOGI("scaling the swapchain, %s replaced by %s",
+			drm_kms_swap_mode_names[drm->swap_mode],
+			drm_kms_swap_mode_names[DRM_SWAP_SETCRTC]);
+		drm->swap_mode = DRM_SWAP_SETCRTC;
+	}
 
-		memset(&drm->evctx, 0, sizeof(drm->evctx));
-		drm->evctx.version = DRM_EVENT_CONTEXT_VERSION;
-		drm->evctx.page_flip_handler = page_flip_handler;
+	memset(&drm->evctx, 0, sizeof(drm->evctx));
+	drm->evctx.version = DRM_EVENT_CONTEXT_VERSION;
+	drm->evctx.page_flip_handler = page_flip_handler;
+	drm->evctx.vblank_handler = vblank_handler;
+
+	if (drm->swap_mode == DRM_SWAP_COPY) {
+		int count, i;
 
 		/*
-		 * XXX GPU tends to freeze if the program is terminiated with a
-		 * flip pending.  What is the right way to handle the
-		 * situation?
+		 * create the real front buffers; with more than one, a post is
+		 * copied to a front that is not scanned out and flipped to, or
+		 * set on the crtc when the kernel cannot flip, but vmwgfx needs
+		 * its dirty rectangles on the scanned out fb
 		 */
-		sigemptyset(&act.sa_mask);
-		act.sa_handler = on_signal;
-		act.sa_flags = 0;
-		sigaction(SIGINT, &act, NULL);
-		sigaction(SIGTERM, &act, NULL);
-
-		drm_singleton = drm;
-	}
-	else if (drm->swap_mode == DRM_SWAP_COPY) {
-		struct gralloc_drm_bo_t *front;
-		int stride;
+		property_get("debug.drm.copy.fronts", value, "3");
+		count = atoi(value);
+		if (count < 1 || drm->mode_quirk_vmwgfx)
+			count = 1;
+		if (count > GRALLOC_DRM_MAX_COPY_FRONTS)
+			count = GRALLOC_DRM_MAX_COPY_FRONTS;
+
+		for (i = 0; i < count; i++) {
+			struct gralloc_drm_bo_t *front;
+
+			front = gralloc_drm_bo_create(drm,
+						      drm->primary->mode.hdisplay,
+						      drm->primary->mode.vdisplay,
+						      drm->primary->fb_format,
+						      GRALLOC_USAGE_HW_FB);
+			if (front && gralloc_drm_bo_add_fb(front)) {
+				gralloc_drm_bo_decref(front);
+				front = NULL;
+			}
+			if (!front)
+				break;
 
-		/* create the real front buffer */
-		front = gralloc_drm_bo_create(drm,
-					      drm->primary.mode.hdisplay,
-					      drm->primary.mode.vdisplay,
-					      drm->primary.fb_format,
-					      GRALLOC_USAGE_HW_FB);
-		if (front && gralloc_drm_bo_add_fb(front)) {
-			gralloc_drm_bo_decref(front);
-			front = NULL;
+			drm->copy_fronts[i] = front;
+			drm->copy_dirty_count[i] = 0;
 		}
+		drm->copy_front_count = i;
 
 		/* abuse next_front */
-		if (front)
-			drm->next_front = front;
-		else
+		if (drm->copy_front_count) {
+			drm->next_front = drm->copy_fronts[0];
+			ALOGD("copying to %d front buffers",
+					drm->copy_front_count);
+		}
+		else {
 			drm->swap_mode = DRM_SWAP_SETCRTC;
+		}
 	}
 
-	switch (drm->swap_mode) {
-	case DRM_SWAP_FLIP:
-		swap_mode = "flip";
-		break;
-	case DRM_SWAP_COPY:
-		swap_mode = "copy";
-		break;
-	case DRM_SWAP_SETCRTC:
-		swap_mode = "set-crtc";
-		break;
-	default:
-		swap_mode = "no-op";
-		break;
-	}
-
-	ALOGD("will use %s for fb posting", swap_mode);
+	ALOGD("will use %s for fb posting",
+		drm_kms_swap_mode_names[drm->swap_mode]);
 }
 
 #define MARGIN_PERCENT 1.8   /* % of active vertical image*/
@@ -848,6 +4355,51 @@ static drmModeModeInfoPtr find_mode(drmModeConnectorPtr connector, int *bpp)
 	if (!mode)
 		mode = &connector->modes[0];
 
+	/*
+	 * at the resolution, the refresh rate closest to the asked one, in
+	 * mHz so that 59.94 Hz can be asked for; or else the rate of the
+	 * mode.  Progressive modes are preferred to interlaced ones.
+	 */
+	if (!forcemode) {
+		drmModeModeInfoPtr best = NULL;
+		int target, best_dist = INT_MAX, best_interlaced = 1;
+		double hz = 0;
+
+		if (property_get("debug.drm.mode.refresh", value, NULL))
+			hz = strtod(value, NULL);
+		target = (hz > 0) ? (int) (hz * 1000 + 0.5) :
+			drm_kms_mode_mhz(mode);
+
+		for (i = 0; i < connector->count_modes; i++) {
+			drmModeModeInfoPtr m = &connector->modes[i];
+			int interlaced, tmp;
+
+			if (m->hdisplay != mode->hdisplay ||
+			    m->vdisplay != mode->vdisplay)
+				continue;
+
+			interlaced = !!(m->flags & DRM_MODE_FLAG_INTERLACE);
+			tmp = abs(drm_kms_mode_mhz(m) - target);
+
+			/* interlaced only without a progressive mode */
+			if (best && interlaced != best_interlaced) {
+				if (interlaced)
+					continue;
+			}
+			/* the mode chosen above wins a tie */
+			else if (best && (tmp > best_dist ||
+					  (tmp == best_dist && m != mode))) {
+				continue;
+			}
+
+			best = m;
+			best_dist = tmp;
+			best_interlaced = interlaced;
+		}
+		if (best)
+			mode = best;
+	}
+
 	ALOGI("Established mode:");
 	ALOGI("clock: %d, hdisplay: %d, hsync_start: %d, hsync_end: %d, htotal: %d, hskew: %d", mode->clock, mode->hdisplay, mode->hsync_start, mode->hsync_end, mode->htotal, mode->hskew);
 	ALOGI("vdisplay: %d, vsync_start: %d, vsync_end: %d, vtotal: %d, vscan: %d, vrefresh: %d", mode->vdisplay, mode->vsync_start, mode->vsync_end, mode->vtotal, mode->vscan, mode->vrefresh);
@@ -858,6 +4410,192 @@ static drmModeModeInfoPtr find_mode(drmModeConnectorPtr connector, int *bpp)
 	return mode;
 }
 
+/*
+ * Return the index of the free crtc a connector is lit with, by firmware or
+ * fbcon, or -1.
+ */
+static int drm_kms_lit_crtc(struct gralloc_drm_t *drm,
+		drmModeConnectorPtr connector)
+{
+	drmModeEncoderPtr encoder;
+	int i;
+
+	if (!connector->encoder_id)
+		return -1;
+
+	encoder = drmModeGetEncoder(drm->fd, connector->encoder_id);
+	if (!encoder)
+		return -1;
+
+	for (i = 0; i < drm->resources->count_crtcs; i++) {
+		if (encoder->crtc_id &&
+		    drm->resources->crtcs[i] == encoder->crtc_id &&
+		    !(drm->used_crtcs & (1 << i)))
+			break;
+	}
+	drmModeFreeEncoder(encoder);
+
+	return (i < drm->resources->count_crtcs) ? i : -1;
+}
+
+/*
+ * Check whether the crtc of an output already shows a fb at the chosen
+ * mode.  The first post can then flip to it without a modeset.
+ */
+static void drm_kms_adopt_crtc(struct gralloc_drm_t *drm,
+		struct gralloc_drm_output *output)
+{
+	drmModeCrtcPtr crtc;
+
+	output->adopted = 0;
+
+	crtc = drmModeGetCrtc(drm->fd, output->crtc_id);
+	if (!crtc)
+		return;
+
+	if (crtc->mode_valid && crtc->buffer_id &&
+	    drm_kms_mode_equal(&crtc->mode, &output->mode)) {
+		ALOGI("crtc %d is lit at %s, taking it over without a modeset",
+			output->crtc_id, output->mode.name);
+		output->adopted = 1;
+	}
+
+	drmModeFreeCrtc(crtc);
+}
+
+/*
+ * Look up a property of a KMS object by name.  Return its id, or 0 when the
+ * object does not have it; its value is stored when value is not NULL.
+ */
+static uint32_t drm_kms_find_prop(struct gralloc_drm_t *drm,
+		uint32_t obj_id, uint32_t obj_type, const char *name,
+		uint64_t *value)
+{
+	drmModeObjectPropertiesPtr props;
+	uint32_t i, prop_id = 0;
+
+	props = drmModeObjectGetProperties(drm->fd, obj_id, obj_type);
+	if (!props)
+		return 0;
+
+	for (i = 0; i < props->count_props && !prop_id; i++) {
+		drmModePropertyPtr prop = drmModeGetProperty(drm->fd,
+				props->props[i]);
+
+		if (!prop)
+			continue;
+
+		if (!strcmp(prop->name, name)) {
+			prop_id = prop->prop_id;
+			if (value)
+				*value = props->prop_values[i];
+		}
+
+		drmModeFreeProperty(prop);
+	}
+
+	drmModeFreeObjectProperties(props);
+
+	return prop_id;
+}
+
+/*
+ * Read the vertical refresh range of a monitor from the range limits
+ * descriptor of its EDID.
+ */
+static int drm_kms_edid_vrange(struct gralloc_drm_t *drm, uint32_t blob_id,
+		int *min_hz, int *max_hz)
+{
+	drmModePropertyBlobPtr blob;
+	const uint8_t *edid;
+	int i, ret = -EINVAL;
+
+	blob = drmModeGetPropertyBlob(drm->fd, blob_id);
+	if (!blob)
+		return -EINVAL;
+
+	edid = (const uint8_t *) blob->data;
+	for (i = 0; blob->length >= 128 && i < 4; i++) {
+		const uint8_t *desc = edid + 54 + 18 * i;
+
+		/* a display descriptor, tagged range limits */
+		if (desc[0] || desc[1] || desc[2] || desc[3] != 0xfd)
+			continue;
+
+		*min_hz = desc[5];
+		*max_hz = desc[6];
+		/* rate offsets for over 255 Hz */
+		if (desc[4] & 0x01)
+			*min_hz += 255;
+		if (desc[4] & 0x02)
+			*max_hz += 255;
+		ret = 0;
+		break;
+	}
+
+	drmModeFreePropertyBlob(blob);
+
+	return ret;
+}
+
+/*
+ * Turn variable refresh on for an output when its connector and crtc
+ * support it and the mode is in the range of the monitor.  Flips are then
+ * shown as soon as they are made, rather than on fixed vblanks.  Set
+ * debug.drm.vrr to 0 to keep a fixed refresh.
+ */
+static void drm_kms_init_vrr(struct gralloc_drm_t *drm,
+		struct gralloc_drm_output *output)
+{
+	char value[PROPERTY_VALUE_MAX];
+	uint64_t capable = 0, edid = 0;
+	int min_hz = 0, max_hz = 0;
+	uint32_t prop_id;
+
+	output->vrr = 0;
+
+	property_get("debug.drm.vrr", value, "1");
+	if (!atoi(value) || drm->swap_mode != DRM_SWAP_FLIP)
+		return;
+
+	if (!drm_kms_find_prop(drm, output->connector_id,
+			DRM_MODE_OBJECT_CONNECTOR, "vrr_capable", &capable) ||
+	    !capable)
+		return;
+
+	prop_id = drm_kms_find_prop(drm, output->crtc_id,
+			DRM_MODE_OBJECT_CRTC, "VRR_ENABLED", NULL);
+	if (!prop_id)
+		return;
+
+	if (drm_kms_find_prop(drm, output->connector_id,
+			DRM_MODE_OBJECT_CONNECTOR, "EDID", &edid) && edid &&
+	    !drm_kms_edid_vrange(drm, edid, &min_hz, &max_hz)) {
+		if ((int) output->mode.vrefresh < min_hz ||
+		    (int) output->mode.vrefresh > max_hz ||
+		    max_hz <= min_hz) {
+			ALOGI("mode %s is out of the %d-%d Hz variable refresh range",
+				output->mode.name, min_hz, max_hz);
+			return;
+		}
+	}
+
+	if (drmModeObjectSetProperty(drm->fd, output->crtc_id,
+			DRM_MODE_OBJECT_CRTC, prop_id, 1)) {
+		ALOGE("failed to enable variable refresh on crtc %d (%s)",
+			output->crtc_id, strerror(errno));
+		return;
+	}
+
+	ALOGI("variable refresh on crtc %d, %d-%d Hz", output->crtc_id,
+		min_hz, (max_hz) ? max_hz : (int) output->mode.vrefresh);
+
+	output->vrr = 1;
+	output->vrr_prop_id = prop_id;
+	output->vrr_min_hz = min_hz;
+	output->vrr_max_hz = (max_hz) ? max_hz : (int) output->mode.vrefresh;
+}
+
 /*
  * Initialize KMS with a connector.
  */
@@ -866,7 +4604,6 @@ static int drm_kms_init_with_connector(struct gralloc_drm_t *drm,
 {
 	drmModeEncoderPtr encoder;
 	drmModeModeInfoPtr mode;
-	static int used_crtcs = 0;
 	int bpp, i;
 
 	if (!connector->count_modes)
@@ -876,24 +4613,45 @@ static int drm_kms_init_with_connector(struct gralloc_drm_t *drm,
 	if (!encoder)
 		return -EINVAL;
 
-	/* find first possible crtc which is not used yet */
-	for (i = 0; i < drm->resources->count_crtcs; i++) {
-		if (encoder->possible_crtcs & (1 << i) &&
-			(used_crtcs & (1 << i)) != (1 << i))
-			break;
+	/* an output initialized again, on hotplug, gives its crtc back */
+	if (output->crtc_id) {
+		drm->used_crtcs &= ~(1 << output->pipe);
+		output->crtc_id = 0;
+	}
+
+	/*
+	 * keep the crtc the connector is lit with, else find first possible
+	 * crtc which is not used yet
+	 */
+	i = drm_kms_lit_crtc(drm, connector);
+	if (i < 0) {
+		for (i = 0; i < drm->resources->count_crtcs; i++) {
+			if (encoder->possible_crtcs & (1 << i) &&
+				(drm->used_crtcs & (1 << i)) != (1 << i))
+				break;
+		}
 	}
 
-	used_crtcs |= (1 << i);
+	drm->used_crtcs |= (1 << i);
 
 	drmModeFreeEncoder(encoder);
 	if (i == drm->resources->count_crtcs)
 		return -EINVAL;
 
 	output->bo = NULL;
+	output->drm = drm;
 	output->crtc_id = drm->resources->crtcs[i];
 	output->connector_id = connector->connector_id;
 	output->pipe = i;
 
+	/* what the crtc showed before us, unless we have lit it since */
+	if (!output->saved_crtc ||
+	    output->saved_crtc->crtc_id != output->crtc_id) {
+		if (output->saved_crtc)
+			drmModeFreeCrtc(output->saved_crtc);
+		output->saved_crtc = drmModeGetCrtc(drm->fd, output->crtc_id);
+	}
+
 	/* print connector info */
 	if (connector->count_modes > 1) {
 		ALOGI("there are %d modes on connector 0x%x, type %d",
@@ -914,6 +4672,14 @@ static int drm_kms_init_with_connector(struct gralloc_drm_t *drm,
 	ALOGI("the best mode is %s", mode->name);
 
 	output->mode = *mode;
+
+	pthread_mutex_lock(&drm->vsync_mutex);
+	drm_kms_vsync_reset(&output->vsync, &output->mode);
+	pthread_mutex_unlock(&drm->vsync_mutex);
+
+	/* plane checks were made against the previous mode */
+	drm_kms_plane_check_flush(drm);
+
 	switch (bpp) {
 	case 2:
 		output->fb_format = HAL_PIXEL_FORMAT_RGB_565;
@@ -933,141 +4699,463 @@ static int drm_kms_init_with_connector(struct gralloc_drm_t *drm,
 		output->ydpi = 75;
 	}
 
-#ifdef DRM_MODE_FEATURE_DIRTYFB
-	drm->clip.x1 = 0;
-	drm->clip.y1 = 0;
-	drm->clip.x2 = output->mode.hdisplay;
-	drm->clip.y2 = output->mode.vdisplay;
+#ifdef DRM_MODE_FEATURE_DIRTYFB
+	drm->clip.x1 = 0;
+	drm->clip.y1 = 0;
+	drm->clip.x2 = output->mode.hdisplay;
+	drm->clip.y2 = output->mode.vdisplay;
+#endif
+
+	return 0;
+}
+
+
+/*
+ * Return true if a connector is driven by an output.
+ */
+static int drm_kms_connector_used(struct gralloc_drm_t *drm,
+		uint32_t connector_id)
+{
+	int i;
+
+	for (i = 0; i < drm->output_count; i++) {
+		if (drm->outputs[i].active &&
+		    drm->outputs[i].connector_id == connector_id)
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Get a connector.  Unless probe is true, the state the kernel already has
+ * is used when it is complete, which saves a probe and its EDID reads.
+ */
+static drmModeConnectorPtr drm_kms_get_connector(struct gralloc_drm_t *drm,
+		uint32_t connector_id, int probe)
+{
+	drmModeConnectorPtr connector = NULL;
+
+#ifdef HAVE_DRM_GET_CONNECTOR_CURRENT
+	if (!probe) {
+		connector = drmModeGetConnectorCurrent(drm->fd, connector_id);
+
+		/* never probed, or no modes to choose from */
+		if (connector &&
+		    (connector->connection == DRM_MODE_UNKNOWNCONNECTION ||
+		     (connector->connection == DRM_MODE_CONNECTED &&
+		      !connector->count_modes))) {
+			drmModeFreeConnector(connector);
+			connector = NULL;
+		}
+	}
 #endif
 
+	if (!connector)
+		connector = drmModeGetConnector(drm->fd, connector_id);
+
+	return connector;
+}
+
+/*
+ * Take a snapshot of all connectors, each probed at most once.  The
+ * snapshot is updated on hotplug.
+ */
+static int drm_kms_snapshot_connectors(struct gralloc_drm_t *drm)
+{
+	int i;
+
+	drm->connectors = calloc(drm->resources->count_connectors,
+			sizeof(*drm->connectors));
+	if (!drm->connectors)
+		return -ENOMEM;
+
+	for (i = 0; i < drm->resources->count_connectors; i++)
+		drm->connectors[i] = drm_kms_get_connector(drm,
+				drm->resources->connectors[i], 0);
+
 	return 0;
 }
 
+/*
+ * Free the connector snapshot.
+ */
+static void drm_kms_free_connectors(struct gralloc_drm_t *drm)
+{
+	int i;
+
+	if (!drm->connectors)
+		return;
+
+	for (i = 0; i < drm->resources->count_connectors; i++) {
+		if (drm->connectors[i])
+			drmModeFreeConnector(drm->connectors[i]);
+	}
+	free(drm->connectors);
+	drm->connectors = NULL;
+}
 
 /*
- * Fetch a connector of particular type
+ * Return the first connected connector of a type that is not driven yet,
+ * from the snapshot.
  */
 static drmModeConnectorPtr fetch_connector(struct gralloc_drm_t *drm,
 	uint32_t type)
 {
 	int i;
 
-	if (!drm->resources)
+	if (!drm->resources || !drm->connectors)
 		return NULL;
 
 	for (i = 0; i < drm->resources->count_connectors; i++) {
-		drmModeConnectorPtr connector =
-			connector = drmModeGetConnector(drm->fd,
-				drm->resources->connectors[i]);
-		if (connector) {
-			if (connector->connector_type == type &&
-				connector->connection == DRM_MODE_CONNECTED)
-				return connector;
-			drmModeFreeConnector(connector);
-		}
+		drmModeConnectorPtr connector = drm->connectors[i];
+
+		/* skip connectors driven by other outputs */
+		if (!connector ||
+		    drm_kms_connector_used(drm, connector->connector_id))
+			continue;
+
+		if (connector->connector_type == type &&
+			connector->connection == DRM_MODE_CONNECTED)
+			return connector;
 	}
 	return NULL;
 }
 
+/*
+ * Drive a connector as an extended output, in the first free display.
+ * Return the display, or -1 when there is no free display or crtc.
+ */
+static int init_extended_output(struct gralloc_drm_t *drm,
+		drmModeConnectorPtr connector)
+{
+	struct gralloc_drm_output *output;
+	int disp;
+
+	/* reuse a display left by an unplugged output */
+	for (disp = 2; disp < drm->output_count; disp++) {
+		if (!drm->outputs[disp].active)
+			break;
+	}
+	if (disp >= drm->resources->count_crtcs + 2)
+		return -1;
+
+	output = &drm->outputs[disp];
+	if (drm_kms_init_with_connector(drm, output, connector))
+		return -1;
+
+	ALOGD("extended display %d on connector %d, type %d [%dx%d]",
+		disp, connector->connector_id, connector->connector_type,
+		output->mode.hdisplay, output->mode.vdisplay);
+
+	output->first_post = 1;
+	output->current_front = NULL;
+	output->next_front = NULL;
+	output->active = 1;
+	if (disp == drm->output_count)
+		drm->output_count++;
+
+	return disp;
+}
+
+/*
+ * Drive the connected connectors not used by the primary or hdmi as
+ * extended outputs, as long as there are crtcs for them.
+ */
+static void init_extended_outputs(struct gralloc_drm_t *drm)
+{
+	int i;
+
+	for (i = 0; i < drm->resources->count_connectors; i++) {
+		drmModeConnectorPtr connector = drm->connectors[i];
+
+		if (!connector ||
+		    drm_kms_connector_used(drm, connector->connector_id))
+			continue;
+
+		if (connector->connection == DRM_MODE_CONNECTED)
+			init_extended_output(drm, connector);
+	}
+}
 
 /*
  * Initializes hdmi output with a connector and allocates
  * a private framebuffer for it. This is called on startup if
  * hdmi cable is connected and also on hotplug events.
  */
-static void init_hdmi_output(struct gralloc_drm_t *drm,
+static int init_hdmi_output(struct gralloc_drm_t *drm,
 	drmModeConnectorPtr connector)
 {
-	drm_kms_init_with_connector(drm, &drm->hdmi, connector);
+	char value[PROPERTY_VALUE_MAX];
+
+	if (drm_kms_init_with_connector(drm, drm->hdmi, connector))
+		return -EINVAL;
+
+	/* an extended hdmi is posted to through its own fb device */
+	property_get("debug.drm.hdmi.mode", value, "cloned");
+	if (!strcmp(value, "extended")) {
+		ALOGD("%s, hdmi extended [%dx%d]", __func__,
+			drm->hdmi->mode.hdisplay, drm->hdmi->mode.vdisplay);
+
+		drm->hdmi->first_post = 1;
+		drm->hdmi->current_front = NULL;
+		drm->hdmi->next_front = NULL;
+
+		drm->hdmi_mode = HDMI_EXTENDED;
+		drm->hdmi->active = 1;
+		return 0;
+	}
 
 	ALOGD("%s, allocate private buffer for hdmi [%dx%d]",
-		__func__, drm->hdmi.mode.hdisplay, drm->hdmi.mode.vdisplay);
+		__func__, drm->hdmi->mode.hdisplay, drm->hdmi->mode.vdisplay);
 
-	drm->hdmi.bo = gralloc_drm_bo_create(drm,
-		drm->hdmi.mode.hdisplay, drm->hdmi.mode.vdisplay,
-		drm->hdmi.fb_format,
+	drm->hdmi->bo = gralloc_drm_bo_create(drm,
+		drm->hdmi->mode.hdisplay, drm->hdmi->mode.vdisplay,
+		drm->hdmi->fb_format,
 		GRALLOC_USAGE_SW_WRITE_OFTEN|GRALLOC_USAGE_HW_RENDER);
 
-	gralloc_drm_bo_add_fb(drm->hdmi.bo);
+	gralloc_drm_bo_add_fb(drm->hdmi->bo);
 
 	drm->hdmi_mode = HDMI_CLONED;
-	drm->hdmi.active = 1;
+	drm->hdmi->active = 1;
+
+	return 0;
+}
+
+
+/*
+ * Bring an output down after its connector was unplugged.  The caller must
+ * hold hdmi_mutex.
+ */
+static void drm_kms_disconnect_output(struct gralloc_drm_t *drm,
+		struct gralloc_drm_output *output)
+{
+	output->active = 0;
+
+	/* turn the crtc off and give it back */
+	drmModeSetCrtc(drm->fd, output->crtc_id, 0, 0, 0, NULL, 0, NULL);
+	drm->used_crtcs &= ~(1 << output->pipe);
+	output->crtc_id = 0;
+
+	if (output->clone_plane) {
+		output->clone_plane->reserved = 0;
+		output->clone_plane = NULL;
+	}
+
+	if (output->bo) {
+		ALOGD("destroy private buffer of connector %d",
+			output->connector_id);
+		gralloc_drm_bo_decref(output->bo);
+		output->bo = NULL;
+	}
+	if (output->clone_back) {
+		gralloc_drm_bo_decref(output->clone_back);
+		output->clone_back = NULL;
+	}
+	if (output == drm->hdmi)
+		drm_kms_clone_free_copies(drm);
 }
 
+/*
+ * Bring an output up for a plugged connector.  This allocates the buffers
+ * of a cloned hdmi.  Return the display, or -1 on failure.  The caller must
+ * hold hdmi_mutex.
+ */
+static int drm_kms_connect_output(struct gralloc_drm_t *drm,
+		drmModeConnectorPtr connector)
+{
+	if (connector->connector_type != DRM_MODE_CONNECTOR_HDMIA ||
+	    drm->hdmi->active)
+		return init_extended_output(drm, connector);
+
+	if (init_hdmi_output(drm, connector))
+		return -1;
+
+	/* set the hdmi crtc with the next primary frame */
+	if (drm->hdmi_mode == HDMI_CLONED) {
+		pthread_mutex_lock(&drm->clone_mutex);
+		drm->clone_modeset = 1;
+		pthread_mutex_unlock(&drm->clone_mutex);
+	}
+
+	return 1;
+}
 
 /*
- * Thread that listens to uevents and checks if hdmi state changes
+ * Probe a connector again, and bring its output up or down to match.  A
+ * connector not known to have changed is probed only when the kernel state
+ * shows a new connection status.  The primary output stays up.
  */
-static void *hdmi_observer(void *data)
+static void drm_kms_reprobe_connector(struct gralloc_drm_t *drm,
+		uint32_t connector_id, int changed)
 {
-	static char uevent_desc[4096];
-	drmModeConnectorPtr hdmi;
-	struct gralloc_drm_t *drm =
-		(struct gralloc_drm_t *) data;
+	void (*hotplug)(void *data, int disp, int connected);
+	struct gralloc_drm_output *output = NULL;
+	drmModeConnectorPtr connector, cached;
+	void *data;
+	int connected, index, disp = -1, i;
+
+	for (index = 0; index < drm->resources->count_connectors; index++) {
+		if (drm->resources->connectors[index] == connector_id)
+			break;
+	}
+	if (index == drm->resources->count_connectors || !drm->connectors)
+		return;
+
+	connector = drm_kms_get_connector(drm, connector_id, changed);
+	if (!connector)
+		return;
+
+	pthread_mutex_lock(&drm->hdmi_mutex);
+	cached = drm->connectors[index];
+	pthread_mutex_unlock(&drm->hdmi_mutex);
+
+	if (!changed && cached &&
+	    cached->connection == connector->connection) {
+		drmModeFreeConnector(connector);
+		return;
+	}
+
+#ifdef HAVE_DRM_GET_CONNECTOR_CURRENT
+	/* the modes of a new connection are read by a full probe */
+	if (!changed && connector->connection == DRM_MODE_CONNECTED) {
+		drmModeFreeConnector(connector);
+		connector = drmModeGetConnector(drm->fd, connector_id);
+		if (!connector)
+			return;
+	}
+#endif
+
+	connected = (connector->count_modes &&
+		connector->connection == DRM_MODE_CONNECTED);
+
+	pthread_mutex_lock(&drm->hdmi_mutex);
 
-	uevent_init();
+	/* update the snapshot */
+	if (drm->connectors[index])
+		drmModeFreeConnector(drm->connectors[index]);
+	drm->connectors[index] = connector;
 
-	memset(uevent_desc, 0, sizeof(uevent_desc));
+	for (i = 0; i < drm->output_count; i++) {
+		if (drm->outputs[i].active &&
+		    drm->outputs[i].connector_id == connector_id)
+			output = &drm->outputs[i];
+	}
 
-	while(1) {
+	if (output && !connected && output != drm->primary) {
+		disp = output - drm->outputs;
+		drm_kms_disconnect_output(drm, output);
+	}
+	else if (!output && connected) {
+		disp = drm_kms_connect_output(drm, connector);
+	}
 
-		/* this polls */
-		int len = uevent_next_event(uevent_desc, sizeof(uevent_desc) - 2);
+	pthread_mutex_unlock(&drm->hdmi_mutex);
 
-		if(len && strstr(uevent_desc, "devices/virtual/switch/hdmi")) {
+	if (disp < 0)
+		return;
 
-			/* check what changed */
-			const char *prop = uevent_desc + strlen(uevent_desc) + 1;
+	ALOGD("display %d %s", disp, (connected) ? "connected" : "disconnected");
 
-			while (*prop) {
+	pthread_mutex_lock(&drm->event_mutex);
+	/* the crtc is off, the primary bos it cloned can be released */
+	if (!connected && output == drm->hdmi)
+		drm_kms_clone_drop_fronts(drm);
+	hotplug = drm->event_callbacks.hotplug;
+	data = drm->event_data;
+	pthread_mutex_unlock(&drm->event_mutex);
 
-				const char *state = strstr(prop, "SWITCH_STATE=");
-				if (state) {
-					unsigned int value = 0;
-					state += strlen("SWITCH_STATE=");
-					value = atoi(state);
+	if (hotplug)
+		hotplug(data, disp, connected);
+}
 
-					pthread_mutex_lock(&drm->hdmi_mutex);
+/*
+ * Open a netlink socket for kernel uevents.
+ */
+static int drm_kms_open_uevent(void)
+{
+	struct sockaddr_nl addr;
+	int fd;
+
+	fd = socket(PF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK,
+			NETLINK_KOBJECT_UEVENT);
+	if (fd < 0)
+		return -errno;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = 1;	/* from the kernel */
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr))) {
+		int err = -errno;
+
+		close(fd);
+		return err;
+	}
 
-					if (value) {
-						hdmi = fetch_connector(drm, DRM_MODE_CONNECTOR_HDMIA);
-						if (hdmi) {
+	return fd;
+}
 
-							ALOGD("init hdmi on hotplug event");
-							init_hdmi_output(drm, hdmi);
+/*
+ * Dispatch pending uevents without blocking.  A DRM hotplug event
+ * re-probes the connector it names, or every connector when it names none.
+ */
+static void drm_kms_handle_uevents(struct gralloc_drm_t *drm)
+{
+	char buf[4096];
+	ssize_t len;
+	int overflow = 0, i;
 
-							/* will trigger modeset */
-							drm->first_post = 1;
+	if (drm->uevent_fd < 0)
+		return;
 
-							drmModeFreeConnector(hdmi);
+	while (1) {
+		const char *p;
+		uint32_t connector_id = 0;
+		int is_drm = 0, hotplug = 0;
 
-							pthread_mutex_unlock(&drm->hdmi_mutex);
-						}
-						break;
-					} else {
-						drm->hdmi.active = 0;
+		len = recv(drm->uevent_fd, buf, sizeof(buf) - 1, MSG_DONTWAIT);
+		if (len < 0 && errno == EINTR)
+			continue;
+		/* uevents were lost, a hotplug among them maybe */
+		if (len < 0 && errno == ENOBUFS) {
+			ALOGW("uevent socket overflowed");
+			overflow = 1;
+			continue;
+		}
+		if (len <= 0)
+			break;
 
-						ALOGD("destroy hdmi private buffer");
-						gralloc_drm_bo_decref(drm->hdmi.bo);
-						drm->hdmi.bo = NULL;
+		buf[len] = '\0';
 
-						pthread_mutex_unlock(&drm->hdmi_mutex);
-						break;
-					}
+		/* "<action>@<devpath>" then "<key>=<value>", nul separated */
+		for (p = buf; p < buf + len; p += strlen(p) + 1) {
+			if (!strcmp(p, "SUBSYSTEM=drm"))
+				is_drm = 1;
+			else if (!strcmp(p, "HOTPLUG=1"))
+				hotplug = 1;
+			else if (!strncmp(p, "CONNECTOR=", 10))
+				connector_id = strtoul(p + 10, NULL, 10);
+		}
 
-					pthread_mutex_unlock(&drm->hdmi_mutex);
-				}
+		if (!is_drm || !hotplug)
+			continue;
 
-				/* next property/value pair */
-				prop += strlen(prop) + 1;
-				if (prop - uevent_desc >= len)
-					break;
-			}
+		if (connector_id) {
+			drm_kms_reprobe_connector(drm, connector_id, 1);
+			continue;
 		}
+
+		for (i = 0; i < drm->resources->count_connectors; i++)
+			drm_kms_reprobe_connector(drm,
+					drm->resources->connectors[i], 0);
 	}
 
-	pthread_exit(NULL);
-	return 0;
+	/* which connectors changed is unknown, probe them all in full */
+	if (overflow) {
+		for (i = 0; i < drm->resources->count_connectors; i++)
+			drm_kms_reprobe_connector(drm,
+					drm->resources->connectors[i], 1);
+	}
 }
 
 
@@ -1077,22 +5165,74 @@ static void *hdmi_observer(void *data)
 int gralloc_drm_init_kms(struct gralloc_drm_t *drm)
 {
 	drmModeConnectorPtr lvds, hdmi;
+	uint64_t cap;
 	int i, ret;
 
 	if (drm->resources)
 		return 0;
 
+	pthread_mutex_init(&drm->event_mutex, NULL);
+	pthread_mutex_init(&drm->vsync_mutex, NULL);
+	pthread_cond_init(&drm->vsync_cond, NULL);
+	pthread_mutex_init(&drm->plane_check_mutex, NULL);
+	pthread_mutex_init(&drm->cursor_mutex, NULL);
+	pthread_mutex_init(&drm->hdmi_mutex, NULL);
+	pthread_mutex_init(&drm->clone_mutex, NULL);
+	pthread_cond_init(&drm->clone_cond, NULL);
+
+	drm->cursor_width = 64;
+	drm->cursor_height = 64;
+#ifdef DRM_CAP_CURSOR_WIDTH
+	if (!drmGetCap(drm->fd, DRM_CAP_CURSOR_WIDTH, &cap) && cap)
+		drm->cursor_width = cap;
+	if (!drmGetCap(drm->fd, DRM_CAP_CURSOR_HEIGHT, &cap) && cap)
+		drm->cursor_height = cap;
+#endif
+
+	/* clock of vblank and flip event timestamps */
+	if (!drmGetCap(drm->fd, DRM_CAP_TIMESTAMP_MONOTONIC, &cap) && cap)
+		drm->vsync_clock = CLOCK_MONOTONIC;
+	else
+		drm->vsync_clock = CLOCK_REALTIME;
+
 	drm->resources = drmModeGetResources(drm->fd);
 	if (!drm->resources) {
 		ALOGE("failed to get modeset resources");
 		return -EINVAL;
 	}
 
+	/* the primary, hdmi, and an extended output per remaining crtc */
+	drm->outputs = calloc(drm->resources->count_crtcs + 2,
+			sizeof(*drm->outputs));
+	if (!drm->outputs) {
+		drmModeFreeResources(drm->resources);
+		drm->resources = NULL;
+		return -ENOMEM;
+	}
+	drm->output_count = 2;
+	drm->primary = &drm->outputs[0];
+	drm->hdmi = &drm->outputs[1];
+	drm->primary->drm = drm;
+	drm->hdmi->drm = drm;
+
+#if defined(DRM_CLIENT_CAP_ATOMIC) && defined(DRM_MODE_ATOMIC_TEST_ONLY)
+	/* for test-only commits; this also exposes primary and cursor planes */
+	if (!drmSetClientCap(drm->fd, DRM_CLIENT_CAP_ATOMIC, 1))
+		drm->atomic = 1;
+#endif
+
 	drm->plane_resources = drmModeGetPlaneResources(drm->fd);
 	if (!drm->plane_resources) {
 		ALOGD("no planes found from drm resources");
 	} else {
+		char value[PROPERTY_VALUE_MAX];
+
 		ALOGD("supported drm planes and formats");
+
+		/* per-crtc plane fetch limit in KiB per frame */
+		if (property_get("debug.drm.plane.bandwidth", value, NULL))
+			drm->plane_bandwidth = strtoull(value, NULL, 0) * 1024;
+
 		/* fill a helper structure for hwcomposer */
 		drm->planes = calloc(drm->plane_resources->count_planes,
 			sizeof(struct gralloc_drm_plane_t));
@@ -1104,7 +5244,12 @@ int gralloc_drm_init_kms(struct gralloc_drm_t *drm)
 			drm->planes[i].drm_plane = drmModeGetPlane(drm->fd,
 				drm->plane_resources->planes[i]);
 
-			ALOGD("plane id %d", drm->planes[i].drm_plane->plane_id);
+			drm_kms_probe_plane(drm, &drm->planes[i]);
+
+			ALOGD("plane id %d zpos %d%s",
+				drm->planes[i].drm_plane->plane_id,
+				drm->planes[i].zpos,
+				drm->planes[i].overlay ? "" : " (not an overlay)");
 			for (j = 0; j < drm->planes[i].drm_plane->count_formats; j++)
 				ALOGD("    format %c%c%c%c",
 					(drm->planes[i].drm_plane->formats[j]),
@@ -1114,92 +5259,318 @@ int gralloc_drm_init_kms(struct gralloc_drm_t *drm)
 		}
 	}
 
+	/* probe the connectors once */
+	if (drm_kms_snapshot_connectors(drm)) {
+		drmModeFreeResources(drm->resources);
+		drm->resources = NULL;
+		free(drm->outputs);
+		drm->outputs = NULL;
+		drm->output_count = 0;
+
+		return -ENOMEM;
+	}
+
 	/* find the crtc/connector/mode to use */
 	lvds = fetch_connector(drm, DRM_MODE_CONNECTOR_LVDS);
-	if (lvds) {
-		drm_kms_init_with_connector(drm, &drm->primary, lvds);
-		drmModeFreeConnector(lvds);
-		drm->primary.active = 1;
-	}
+	if (lvds && !drm_kms_init_with_connector(drm, drm->primary, lvds))
+		drm->primary->active = 1;
 
 	/* if still no connector, find first connected connector and try it */
-	if (!drm->primary.active) {
+	if (!drm->primary->active) {
 
 		for (i = 0; i < drm->resources->count_connectors; i++) {
-			drmModeConnectorPtr connector;
-
-			connector = drmModeGetConnector(drm->fd,
-					drm->resources->connectors[i]);
-			if (connector) {
-				if (connector->connection == DRM_MODE_CONNECTED) {
-					if (!drm_kms_init_with_connector(drm,
-							&drm->primary, connector))
-						break;
-				}
-
-				drmModeFreeConnector(connector);
+			drmModeConnectorPtr connector = drm->connectors[i];
+
+			if (connector &&
+			    connector->connection == DRM_MODE_CONNECTED &&
+			    !drm_kms_init_with_connector(drm,
+					drm->primary, connector)) {
+				drm->primary->active = 1;
+				break;
 			}
 		}
 		if (i == drm->resources->count_connectors) {
 			ALOGE("failed to find a valid crtc/connector/mode combination");
+			drm_kms_free_connectors(drm);
 			drmModeFreeResources(drm->resources);
 			drm->resources = NULL;
+			free(drm->outputs);
+			drm->outputs = NULL;
+			drm->output_count = 0;
 
 			return -EINVAL;
 		}
 	}
 
 
-	/* check if hdmi is connected already */
+	/* check if hdmi is connected already, other than the primary */
 	hdmi = fetch_connector(drm, DRM_MODE_CONNECTOR_HDMIA);
 	if (hdmi) {
-
-		if (hdmi->connector_id == drm->primary.connector_id) {
-			/* special case: our primary connector is hdmi */
-			ALOGD("hdmi is the primary connector");
-			goto skip_hdmi_modes;
-		}
-
 		ALOGD("init hdmi on startup");
 		init_hdmi_output(drm, hdmi);
-
-		drmModeFreeConnector(hdmi);
 	}
 
-goto skip_hdmi_modes;
-	/* launch hdmi observer thread */
-	pthread_mutex_init(&drm->hdmi_mutex, NULL);
-	pthread_create(&drm->hdmi_hotplug_thread, NULL, hdmi_observer, drm);
-
-skip_hdmi_modes:
+	init_extended_outputs(drm);
 
 	drm_kms_init_features(drm);
 	drm->first_post = 1;
 
+	/* a scaled primary needs a modeset for its background */
+	if (!drm->scaler && drm->swap_mode == DRM_SWAP_FLIP)
+		drm_kms_adopt_crtc(drm, drm->primary);
+
+	drm_kms_init_vrr(drm, drm->primary);
+
+	/* hotplug */
+	drm->uevent_fd = drm_kms_open_uevent();
+	if (drm->uevent_fd < 0)
+		ALOGE("failed to open uevent socket (%s), no hotplug",
+			strerror(-drm->uevent_fd));
+
+	/* probed on a thread of its own, or else with the events */
+	if (drm->uevent_fd >= 0 && !pipe(drm->hotplug_pipe)) {
+		if (pthread_create(&drm->hotplug_thread, NULL,
+					drm_kms_hotplug_loop, drm)) {
+			ALOGE("failed to create hotplug thread");
+			close(drm->hotplug_pipe[0]);
+			close(drm->hotplug_pipe[1]);
+			drm->hotplug_pipe[0] = drm->hotplug_pipe[1] = -1;
+		}
+	}
+	else if (drm->uevent_fd >= 0) {
+		ALOGE("failed to create hotplug pipe");
+		drm->hotplug_pipe[0] = drm->hotplug_pipe[1] = -1;
+	}
+
+	drm_kms_init_signals(drm);
+
+	/* event sources for the compositor */
+	drm->event_fd = epoll_create(1);
+	if (drm->event_fd >= 0) {
+		struct epoll_event ev;
+
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.fd = drm->fd;
+		if (epoll_ctl(drm->event_fd, EPOLL_CTL_ADD, drm->fd, &ev)) {
+			close(drm->event_fd);
+			drm->event_fd = -1;
+		}
+	}
+	if (drm->event_fd >= 0 && drm->uevent_fd >= 0 &&
+	    drm->hotplug_pipe[1] < 0) {
+		struct epoll_event ev;
+
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.fd = drm->uevent_fd;
+		if (epoll_ctl(drm->event_fd, EPOLL_CTL_ADD, drm->uevent_fd, &ev))
+			ALOGE("failed to add uevent socket to event fd");
+	}
+	if (drm->event_fd >= 0 && drm->shutdown_pipe[0] >= 0) {
+		struct epoll_event ev;
+
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.fd = drm->shutdown_pipe[0];
+		if (epoll_ctl(drm->event_fd, EPOLL_CTL_ADD,
+					drm->shutdown_pipe[0], &ev))
+			ALOGE("failed to add shutdown pipe to event fd");
+	}
+	if (drm->event_fd < 0)
+		ALOGE("failed to create event fd");
+
+	/* launch the thread dispatching vblank and flip events */
+	if (!pipe(drm->event_pipe)) {
+		if (pthread_create(&drm->event_thread, NULL,
+					drm_kms_event_loop, drm)) {
+			ALOGE("failed to create event thread");
+			close(drm->event_pipe[0]);
+			close(drm->event_pipe[1]);
+			drm->event_pipe[0] = drm->event_pipe[1] = -1;
+		}
+	}
+	else {
+		ALOGE("failed to create event pipe");
+		drm->event_pipe[0] = drm->event_pipe[1] = -1;
+	}
+
 	return 0;
 }
 
-void gralloc_drm_fini_kms(struct gralloc_drm_t *drm)
+/*
+ * Give a crtc back as it was before the output was initialized, or turn it
+ * off when there is nothing left to show.
+ */
+static void drm_kms_restore_crtc(struct gralloc_drm_t *drm,
+		struct gralloc_drm_output *output)
 {
-	switch (drm->swap_mode) {
-	case DRM_SWAP_FLIP:
-		drm_kms_page_flip(drm, NULL);
-		break;
-	case DRM_SWAP_COPY:
-		{
-			struct gralloc_drm_bo_t **bo = (drm->current_front) ?
-				&drm->current_front : &drm->next_front;
+	drmModeCrtcPtr saved = output->saved_crtc;
+	int ret = -EINVAL;
+
+	if (saved && saved->crtc_id == output->crtc_id &&
+	    saved->mode_valid && saved->buffer_id)
+		ret = drmModeSetCrtc(drm->fd, output->crtc_id,
+				saved->buffer_id, saved->x, saved->y,
+				&output->connector_id, 1, &saved->mode);
+	if (ret)
+		drmModeSetCrtc(drm->fd, output->crtc_id, 0, 0, 0,
+				NULL, 0, NULL);
+}
+
+/*
+ * Quiesce the displays so that the process can go away: drop the post
+ * queued for a vblank, wait for the flips in flight, release the planes and
+ * cursors, and give the crtcs back as they were.  Posts fail after this.
+ * It is called by gralloc_drm_fini_kms, by the platform before the
+ * compositor exits, and when SIGINT or SIGTERM is received.
+ */
+void gralloc_drm_shutdown_kms(struct gralloc_drm_t *drm)
+{
+	unsigned int i;
+
+	if (!drm->primary || drm->shutdown)
+		return;
 
-			if (*bo)
-				gralloc_drm_bo_decref(*bo);
-			*bo = NULL;
+	/* no post can start the clone worker again after this */
+	pthread_mutex_lock(&drm->event_mutex);
+	if (drm->shutdown) {
+		pthread_mutex_unlock(&drm->event_mutex);
+		return;
+	}
+	drm->shutdown = 1;
+	pthread_mutex_unlock(&drm->event_mutex);
+
+	/* the worker takes event_mutex to release its bos */
+	drm_kms_stop_clone_thread(drm);
+
+	pthread_mutex_lock(&drm->event_mutex);
+
+	/* the vblank event of a dropped post still has to be dispatched */
+	if (drm->queued_post) {
+		gralloc_drm_bo_decref(drm->queued_post);
+		drm->queued_post = NULL;
+	}
+	drm_kms_page_flip(drm, NULL);
+
+	for (i = 1; i < (unsigned int) drm->output_count; i++) {
+		struct gralloc_drm_output *output = &drm->outputs[i];
+		int pending;
+
+		do {
+			pthread_mutex_lock(&drm->clone_mutex);
+			pending = output->flip_pending;
+			pthread_mutex_unlock(&drm->clone_mutex);
+
+			pending |= (output->next_front != NULL);
+			if (pending && drm_kms_handle_events(drm, 1000) <= 0) {
+				ALOGE("no event for the pending flip of display %d",
+						i);
+				output->flip_pending = 0;
+				output->next_front = NULL;
+				pending = 0;
+			}
+		} while (pending);
+	}
+
+	if (drm->planes) {
+		for (i = 0; i < drm->plane_resources->count_planes; i++) {
+			struct gralloc_drm_plane_t *plane = &drm->planes[i];
+
+			if (plane != drm->scaler &&
+			    (!plane->committed || !plane->state.fb_id))
+				continue;
+
+			drmModeSetPlane(drm->fd, plane->drm_plane->plane_id,
+					(plane == drm->scaler) ?
+					drm->primary->crtc_id :
+					plane->state.crtc_id,
+					0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+			plane->committed = 0;
+			if (plane->prev) {
+				gralloc_drm_bo_decref(plane->prev);
+				plane->prev = NULL;
+			}
 		}
-		break;
-	default:
-		break;
 	}
 
-	/* restore crtc? */
+	drm_kms_cursor_fini(drm);
+
+	/* leave the crtc at a fixed refresh for whoever comes next */
+	if (drm->primary->vrr) {
+		drmModeObjectSetProperty(drm->fd, drm->primary->crtc_id,
+				DRM_MODE_OBJECT_CRTC, drm->primary->vrr_prop_id, 0);
+		drm->primary->vrr = 0;
+	}
+
+	pthread_mutex_lock(&drm->hdmi_mutex);
+	for (i = 0; i < (unsigned int) drm->output_count; i++) {
+		struct gralloc_drm_output *output = &drm->outputs[i];
+
+		if (output->active && output->crtc_id)
+			drm_kms_restore_crtc(drm, output);
+	}
+	pthread_mutex_unlock(&drm->hdmi_mutex);
+
+	/* hdmi shows what was restored */
+	drm_kms_clone_drop_fronts(drm);
+
+	pthread_mutex_unlock(&drm->event_mutex);
+
+	ALOGI("displays shut down");
+}
+
+void gralloc_drm_fini_kms(struct gralloc_drm_t *drm)
+{
+	int i;
+
+	/* stop the vsync thread */
+	if (drm->vsync_thread_started) {
+		pthread_mutex_lock(&drm->vsync_mutex);
+		drm->vsync_quit = 1;
+		pthread_cond_signal(&drm->vsync_cond);
+		pthread_mutex_unlock(&drm->vsync_mutex);
+		pthread_join(drm->vsync_thread, NULL);
+		drm->vsync_thread_started = 0;
+	}
+
+	/* drain the flips, and stop the hdmi clone worker */
+	gralloc_drm_shutdown_kms(drm);
+
+	/* stop the event and hotplug threads */
+	drm_kms_stop_event_thread(drm);
+	drm_kms_stop_hotplug_thread(drm);
+
+	if (drm->event_fd >= 0) {
+		close(drm->event_fd);
+		drm->event_fd = -1;
+	}
+	if (drm->uevent_fd >= 0) {
+		close(drm->uevent_fd);
+		drm->uevent_fd = -1;
+	}
+	if (drm->shutdown_pipe[0] >= 0) {
+		drm_kms_shutdown_fd = -1;
+		close(drm->shutdown_pipe[0]);
+		close(drm->shutdown_pipe[1]);
+		drm->shutdown_pipe[0] = drm->shutdown_pipe[1] = -1;
+	}
+
+	if (drm->swap_mode == DRM_SWAP_COPY) {
+		for (i = 0; i < drm->copy_front_count; i++)
+			gralloc_drm_bo_decref(drm->copy_fronts[i]);
+		drm->copy_front_count = 0;
+	}
+	drm->current_front = NULL;
+	drm->next_front = NULL;
+
+	drm->scaler = NULL;
+	if (drm->primary->bo) {
+		gralloc_drm_bo_decref(drm->primary->bo);
+		drm->primary->bo = NULL;
+	}
+
+	drm_kms_free_connectors(drm);
 
 	if (drm->resources) {
 		drmModeFreeResources(drm->resources);
@@ -1219,11 +5590,24 @@ void gralloc_drm_fini_kms(struct gralloc_drm_t *drm)
 		drm->plane_resources = NULL;
 	}
 
-	/* destroy private buffer of hdmi output */
-	if (drm->hdmi.bo)
-		gralloc_drm_bo_decref(drm->hdmi.bo);
+	/* destroy private buffers of hdmi output */
+	if (drm->hdmi->bo)
+		gralloc_drm_bo_decref(drm->hdmi->bo);
+	if (drm->hdmi->clone_back)
+		gralloc_drm_bo_decref(drm->hdmi->clone_back);
+	drm_kms_clone_free_copies(drm);
 
-	drm_singleton = NULL;
+	for (i = 0; i < drm->output_count; i++)
+		if (drm->outputs[i].saved_crtc)
+			drmModeFreeCrtc(drm->outputs[i].saved_crtc);
+
+	free(drm->outputs);
+	drm->outputs = NULL;
+	drm->primary = drm->hdmi = NULL;
+	drm->output_count = 0;
+	drm->used_crtcs = 0;
+
+	drm_kms_fb_cache_flush(drm);
 }
 
 int gralloc_drm_is_kms_initialized(struct gralloc_drm_t *drm)
@@ -1238,16 +5622,51 @@ void gralloc_drm_get_kms_info(struct gralloc_drm_t *drm,
 		struct framebuffer_device_t *fb)
 {
 	*((uint32_t *) &fb->flags) = 0x0;
-	*((uint32_t *) &fb->width) = drm->primary.mode.hdisplay;
-	*((uint32_t *) &fb->height) = drm->primary.mode.vdisplay;
-	*((int *)      &fb->stride) = drm->primary.mode.hdisplay;
-	*((float *)    &fb->fps) = drm->primary.mode.vrefresh;
-
-	*((int *)      &fb->format) = drm->primary.fb_format;
-	*((float *)    &fb->xdpi) = drm->primary.xdpi;
-	*((float *)    &fb->ydpi) = drm->primary.ydpi;
+	*((uint32_t *) &fb->width) = drm->render_width;
+	*((uint32_t *) &fb->height) = drm->render_height;
+	*((int *)      &fb->stride) = drm->render_width;
+	*((float *)    &fb->fps) = drm->primary->mode.vrefresh;
+
+	*((int *)      &fb->format) = drm->primary->fb_format;
+	*((float *)    &fb->xdpi) = drm->primary->xdpi;
+	*((float *)    &fb->ydpi) = drm->primary->ydpi;
+	*((int *)      &fb->minSwapInterval) = drm->swap_interval;
+	*((int *)      &fb->maxSwapInterval) = drm->swap_interval;
+}
+
+/*
+ * Initialize a framebuffer device with the KMS info of an extended output.
+ * Return -ENODEV when the output is not connected or is a clone.
+ */
+int gralloc_drm_get_display_kms_info(struct gralloc_drm_t *drm, int disp,
+		struct framebuffer_device_t *fb)
+{
+	struct gralloc_drm_output *output;
+
+	if (disp <= 0 || disp >= drm->output_count)
+		return -ENODEV;
+	output = &drm->outputs[disp];
+
+	pthread_mutex_lock(&drm->hdmi_mutex);
+	if (!output->active || !drm_kms_output_extended(drm, output)) {
+		pthread_mutex_unlock(&drm->hdmi_mutex);
+		return -ENODEV;
+	}
+
+	*((uint32_t *) &fb->flags) = 0x0;
+	*((uint32_t *) &fb->width) = output->mode.hdisplay;
+	*((uint32_t *) &fb->height) = output->mode.vdisplay;
+	*((int *)      &fb->stride) = output->mode.hdisplay;
+	*((float *)    &fb->fps) = output->mode.vrefresh;
+
+	*((int *)      &fb->format) = output->fb_format;
+	*((float *)    &fb->xdpi) = output->xdpi;
+	*((float *)    &fb->ydpi) = output->ydpi;
 	*((int *)      &fb->minSwapInterval) = drm->swap_interval;
 	*((int *)      &fb->maxSwapInterval) = drm->swap_interval;
+	pthread_mutex_unlock(&drm->hdmi_mutex);
+
+	return 0;
 }
 
 /*
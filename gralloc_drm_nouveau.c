@@ -384,18 +384,19 @@ static void nouveau_init_kms_features(struct gralloc_drm_drv_t *drv,
 {
 	struct nouveau_info *info = (struct nouveau_info *) drv;
 
-	switch (drm->primary.fb_format) {
+	switch (drm->primary->fb_format) {
 	case HAL_PIXEL_FORMAT_BGRA_8888:
 	/* pstglia: This mode (HAL_PIXEL_FORMAT_RGB_565) was not supported in my tests - so I disabled it*/
 	/* please confirm it */
 	case HAL_PIXEL_FORMAT_RGB_565:
 		break;
 	default:
-		drm->primary.fb_format = HAL_PIXEL_FORMAT_BGRA_8888;
+		drm->primary->fb_format = HAL_PIXEL_FORMAT_BGRA_8888;
 		break;
 	}
 
 	drm->mode_quirk_vmwgfx = 0;
+	drm->mode_page_flip = 1;
 	drm->swap_mode = (info->chan) ? DRM_SWAP_FLIP : DRM_SWAP_SETCRTC;
 	drm->mode_sync_flip = 1;
 	drm->swap_interval = 1;
@@ -332,25 +332,75 @@ static void pipe_blit(struct gralloc_drm_drv_t *drv,
 	pthread_mutex_unlock(&pm->mutex);
 }
 
+/*
+ * Blit with scaling and format conversion through the 3D pipeline.
+ */
+static int pipe_scale_blit(struct gralloc_drm_drv_t *drv,
+		struct gralloc_drm_bo_t *dst_bo,
+		struct gralloc_drm_bo_t *src_bo,
+		int dst_x, int dst_y, int dst_w, int dst_h,
+		int src_x, int src_y, int src_w, int src_h)
+{
+	struct pipe_manager *pm = (struct pipe_manager *) drv;
+	struct pipe_buffer *dst = (struct pipe_buffer *) dst_bo;
+	struct pipe_buffer *src = (struct pipe_buffer *) src_bo;
+	struct pipe_blit_info info;
+
+	memset(&info, 0, sizeof(info));
+	info.dst.resource = dst->resource;
+	info.dst.format = dst->resource->format;
+	u_box_2d(dst_x, dst_y, dst_w, dst_h, &info.dst.box);
+	info.src.resource = src->resource;
+	info.src.format = src->resource->format;
+	u_box_2d(src_x, src_y, src_w, src_h, &info.src.box);
+	info.mask = PIPE_MASK_RGBA;
+	info.filter = PIPE_TEX_FILTER_LINEAR;
+
+	pthread_mutex_lock(&pm->mutex);
+
+	if (!pm->context) {
+		pm->context = pm->screen->context_create(pm->screen, NULL);
+		if (!pm->context) {
+			ALOGE("failed to create pipe context");
+			pthread_mutex_unlock(&pm->mutex);
+			return -ENOMEM;
+		}
+	}
+
+	if (!pm->context->blit) {
+		pthread_mutex_unlock(&pm->mutex);
+		return -ENOSYS;
+	}
+
+	pm->context->blit(pm->context, &info);
+	pm->context->flush(pm->context, NULL, 0);
+
+	pthread_mutex_unlock(&pm->mutex);
+
+	return 0;
+}
+
 static void pipe_init_kms_features(struct gralloc_drm_drv_t *drv, struct gralloc_drm_t *drm)
 {
 	struct pipe_manager *pm = (struct pipe_manager *) drv;
 
-	switch (drm->primary.fb_format) {
+	switch (drm->primary->fb_format) {
 	case HAL_PIXEL_FORMAT_BGRA_8888:
 	case HAL_PIXEL_FORMAT_RGB_565:
 		break;
 	default:
-		drm->primary.fb_format = HAL_PIXEL_FORMAT_BGRA_8888;
+		drm->primary->fb_format = HAL_PIXEL_FORMAT_BGRA_8888;
 		break;
 	}
 
 	if (strcmp(pm->driver, "vmwgfx") == 0) {
 		drm->mode_quirk_vmwgfx = 1;
+		drm->mode_page_flip = 0;
 		drm->swap_mode = DRM_SWAP_COPY;
 	}
 	else {
 		drm->mode_quirk_vmwgfx = 0;
+		drm->mode_page_flip = 1;
 		drm->swap_mode = DRM_SWAP_FLIP;
 	}
 	drm->mode_sync_flip = 1;
@@ -558,6 +608,7 @@ struct gralloc_drm_drv_t *gralloc_drm_drv_create_for_pipe(int fd, const char *na
 	pm->base.map = pipe_map;
 	pm->base.unmap = pipe_unmap;
 	pm->base.blit = pipe_blit;
+	pm->base.scale_blit = pipe_scale_blit;
 
 	return &pm->base;
 }
@@ -25,6 +25,7 @@
 #define _GRALLOC_DRM_PRIV_H_
 
 #include <pthread.h>
+#include <time.h>
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 
@@ -47,6 +48,70 @@ enum hdmi_output_mode {
 	HDMI_EXTENDED,
 };
 
+/* how the primary fb gets on a cloned output */
+enum drm_clone_method {
+	DRM_CLONE_BLIT,		/* copied to the private fb */
+	DRM_CLONE_SHARED,	/* scanned out as is, modes and rates match */
+	DRM_CLONE_PLANE,	/* scaled by an overlay over the private fb */
+	DRM_CLONE_COPY,		/* copies scanned out at the hdmi pace */
+};
+
+/* what a plane has been programmed to show */
+struct gralloc_drm_plane_state_t {
+	uint32_t crtc_id;
+	uint32_t fb_id;
+	uint32_t src_x;
+	uint32_t src_y;
+	uint32_t src_w;
+	uint32_t src_h;
+	uint32_t dst_x;
+	uint32_t dst_y;
+	uint32_t dst_w;
+	uint32_t dst_h;
+};
+
+/* a layer on a plane, as validated */
+struct gralloc_drm_plane_config_t {
+	uint32_t plane_id;
+	uint32_t crtc_id;
+	uint32_t format;	/* drm format of the buffer */
+	uint32_t width;		/* size of the buffer */
+	uint32_t height;
+	uint32_t src_x;
+	uint32_t src_y;
+	uint32_t src_w;
+	uint32_t src_h;
+	uint32_t dst_x;
+	uint32_t dst_y;
+	uint32_t dst_w;
+	uint32_t dst_h;
+};
+
+/* cached result of validating a plane configuration */
+struct gralloc_drm_plane_check_t {
+	struct gralloc_drm_plane_config_t config;
+	uint32_t hash;
+	int valid;		/* slot is in use */
+	int result;		/* 0 or negative errno */
+};
+
+#define GRALLOC_DRM_PLANE_CHECK_CACHE_SIZE 64
+
+/* plane properties used for atomic tests */
+enum {
+	GRALLOC_DRM_PLANE_PROP_FB_ID,
+	GRALLOC_DRM_PLANE_PROP_CRTC_ID,
+	GRALLOC_DRM_PLANE_PROP_SRC_X,
+	GRALLOC_DRM_PLANE_PROP_SRC_Y,
+	GRALLOC_DRM_PLANE_PROP_SRC_W,
+	GRALLOC_DRM_PLANE_PROP_SRC_H,
+	GRALLOC_DRM_PLANE_PROP_CRTC_X,
+	GRALLOC_DRM_PLANE_PROP_CRTC_Y,
+	GRALLOC_DRM_PLANE_PROP_CRTC_W,
+	GRALLOC_DRM_PLANE_PROP_CRTC_H,
+	GRALLOC_DRM_PLANE_PROP_COUNT
+};
+
 struct gralloc_drm_plane_t {
 	drmModePlane *drm_plane;
 
@@ -59,6 +124,31 @@ struct gralloc_drm_plane_t {
 	/* identifier set by hwc */
 	uint32_t id;
 
+	/* identifier of the layer shown in the previous frame */
+	uint32_t prev_id;
+
+	/* crtc the plane is reserved on, and its pipe */
+	uint32_t crtc_id;
+	uint32_t pipe;
+
+	/* value of the zpos property, or -1 if the plane has none */
+	int zpos;
+
+	/* plane is an overlay, rather than a primary or cursor plane */
+	int overlay;
+
+	/* bits of the supported rotations, 0 without a rotation property */
+	uint64_t rotations;
+
+	/* property ids, 0 when unknown */
+	uint32_t prop_ids[GRALLOC_DRM_PLANE_PROP_COUNT];
+
+	/* set once the plane has failed to show a scaled layer */
+	int no_scaling;
+
+	/* plane is used by gralloc itself, for scaling or cloning */
+	int reserved;
+
 	/* position, crop and scale */
 	uint32_t src_x;
 	uint32_t src_y;
@@ -71,6 +161,68 @@ struct gralloc_drm_plane_t {
 
 	/* previous buffer, for refcounting */
 	struct gralloc_drm_bo_t *prev;
+
+	/* state last set with drmModeSetPlane, valid when committed */
+	int committed;
+	struct gralloc_drm_plane_state_t state;
+};
+
+/* software model of the vblanks of a crtc */
+struct gralloc_drm_vsync_t {
+	int64_t period;		/* estimated refresh period in ns */
+	int64_t phase;		/* timestamp of the reference vblank in ns */
+	unsigned int seq;	/* sequence of the reference vblank */
+	int samples;		/* samples accepted since the last reset */
+	int outliers;		/* samples rejected in a row */
+};
+
+/* a fb object kept around for the bo it was created for */
+struct gralloc_drm_fb_t {
+	/* key */
+	int name;		/* flink name of the bo */
+	uint32_t format;
+	uint32_t width;
+	uint32_t height;
+	uint32_t pitches[4];
+	uint32_t offsets[4];
+
+	uint32_t fb_id;		/* 0 for a free slot */
+	uint32_t gem_handle;	/* keeps the name alive */
+	int users;		/* bo's using the fb */
+	unsigned int stamp;	/* last use, for LRU eviction */
+};
+
+#define GRALLOC_DRM_FB_CACHE_SIZE 32
+
+/* copies of primary frames a clone at its own pace is updated from */
+#define GRALLOC_DRM_CLONE_COPIES 3
+
+/* damage rectangles kept for a post, more are merged into one */
+#define GRALLOC_DRM_MAX_DAMAGE 16
+
+/* real fronts in copy mode */
+#define GRALLOC_DRM_MAX_COPY_FRONTS 3
+
+/* a cursor image copied to a cursor-sized bo */
+struct gralloc_drm_cursor_t {
+	struct gralloc_drm_bo_t *bo;	/* NULL for a free slot */
+	unsigned char *image;	/* source pixels, rows packed */
+	int format, width, height;	/* of the source */
+	unsigned int stamp;	/* last use, for LRU eviction */
+};
+
+#define GRALLOC_DRM_CURSOR_CACHE_SIZE 4
+
+/* dynamic resolution of the scaled primary swapchain */
+struct gralloc_drm_drs_t {
+	int enabled;
+	uint32_t min_width, min_height;	/* bounds of the render size */
+	uint32_t max_width, max_height;
+	uint32_t width, height;		/* current render size */
+	int scale;			/* of the max size, in 1/256 */
+	int frames;			/* deadlines met in a row */
+	int misses;			/* deadlines recently missed */
+	int64_t slack;			/* average time left before deadlines */
 };
 
 struct gralloc_drm_output
@@ -83,9 +235,41 @@ struct gralloc_drm_output
 	int fb_format;
 	int bpp;
 	uint32_t active;
+	int adopted;	/* lit at the mode before init, no modeset needed */
+	drmModeCrtcPtr saved_crtc;	/* before us, restored on shutdown */
+
+	/* variable refresh, set on the crtc through VRR_ENABLED */
+	int vrr;
+	uint32_t vrr_prop_id;
+	int vrr_min_hz, vrr_max_hz;
 
 	/* 'private fb' for this output */
 	struct gralloc_drm_bo_t *bo;
+
+	struct gralloc_drm_t *drm;	/* owner, for event handlers */
+
+	/* cloning, protected by hdmi_mutex */
+	enum drm_clone_method clone;
+	struct gralloc_drm_plane_t *clone_plane;
+	struct gralloc_drm_bo_t *clone_back;	/* blit target, swapped with bo */
+
+	/* a flip of the clone is in flight, protected by clone_mutex */
+	int flip_pending;
+
+	/* swapchain of an extended output, protected by event_mutex */
+	int first_post;
+	struct gralloc_drm_bo_t *current_front, *next_front;
+
+	/* vsync prediction, protected by vsync_mutex */
+	struct gralloc_drm_vsync_t vsync;
+	void (*vsync_callback)(void *data, int disp, int64_t timestamp);
+	void *vsync_data;
+	int64_t vsync_offset;
+	int64_t vsync_last;	/* vblank of the last callback */
+
+	/* cursor shown, NULL when hidden, protected by cursor_mutex */
+	struct gralloc_drm_cursor_t *cursor;
+	int cursor_hot_x, cursor_hot_y;
 };
 
 struct gralloc_drm_t {
@@ -95,13 +279,47 @@ struct gralloc_drm_t {
 
 	/* initialized by gralloc_drm_init_kms */
 	drmModeResPtr resources;
-	struct gralloc_drm_output primary;
-	struct gralloc_drm_output hdmi;
+	/* snapshot of resources->connectors, updated on hotplug under hdmi_mutex */
+	drmModeConnectorPtr *connectors;
+
+	/*
+	 * outputs, indexed by display: the primary, hdmi even when it is not
+	 * connected, then the extended outputs on the other connectors
+	 */
+	struct gralloc_drm_output *outputs;
+	int output_count;
+	struct gralloc_drm_output *primary;	/* outputs[0] */
+	struct gralloc_drm_output *hdmi;	/* outputs[1] */
+	uint32_t used_crtcs;			/* by pipe */
 	enum hdmi_output_mode hdmi_mode;
 
-	/* hdmi hotplug */
+	/* hdmi hotplug, also protects the state of extended outputs */
 	pthread_mutex_t hdmi_mutex;
-	pthread_t hdmi_hotplug_thread;
+
+	/*
+	 * hdmi clone worker, updating hdmi at its own pace with the latest
+	 * primary frame; frames it has not got to are dropped
+	 */
+	pthread_mutex_t clone_mutex;
+	pthread_cond_t clone_cond;
+	pthread_t clone_thread;
+	int clone_thread_started;
+	int clone_quit;
+	int clone_modeset;
+	unsigned int clone_dropped;
+	int clone_busy;				/* a taken frame is being posted */
+	int clone_shares;			/* flipped with the primary */
+	/* copies of primary frames, owned by hdmi */
+	struct gralloc_drm_bo_t *clone_copies[GRALLOC_DRM_CLONE_COPIES];
+	int clone_copy_count;
+	struct gralloc_drm_bo_t *clone_next;	/* queued, NULL when taken */
+	struct gralloc_drm_bo_t *clone_taken;	/* being shown by the worker */
+	struct gralloc_drm_bo_t *clone_shown, *clone_flipping;
+	/*
+	 * referenced primary bos a sharing hdmi scans out, and is flipping
+	 * to, protected by event_mutex
+	 */
+	struct gralloc_drm_bo_t *clone_front, *clone_pending;
 
 #ifdef DRM_MODE_FEATURE_DIRTYFB
 	drmModeClip clip;
@@ -112,18 +330,89 @@ struct gralloc_drm_t {
 	int swap_interval;
 	int mode_quirk_vmwgfx;
 	int mode_sync_flip; /* page flip should block */
+	int mode_page_flip; /* the kernel can page flip the primary crtc */
 	int vblank_secondary;
 
 	drmEventContext evctx;
 
+	/* vblank and flip events, protects the posting state below */
+	pthread_mutex_t event_mutex;
+	pthread_t event_thread;
+	int event_pipe[2];
+	int event_fd;
+	int uevent_fd;		/* netlink, for hotplug */
+	/* probes connectors on hotplug, away from the event dispatching */
+	pthread_t hotplug_thread;
+	int hotplug_pipe[2];
+	int shutdown_pipe[2];	/* signals asking for a shutdown */
+	int shutdown;		/* displays given back, no more posts */
+	struct gralloc_drm_event_callbacks_t event_callbacks;
+	void *event_data;
+
 	int first_post;
 	struct gralloc_drm_bo_t *current_front, *next_front;
 	int waiting_flip;
 	unsigned int last_swap;
 
+	/*
+	 * real fronts in copy mode, which current_front and next_front point
+	 * to, and the damage each has missed while the others were copied to
+	 */
+	struct gralloc_drm_bo_t *copy_fronts[GRALLOC_DRM_MAX_COPY_FRONTS];
+	int copy_front_count;
+	drmModeClip copy_dirty[GRALLOC_DRM_MAX_COPY_FRONTS][GRALLOC_DRM_MAX_DAMAGE];
+	int copy_dirty_count[GRALLOC_DRM_MAX_COPY_FRONTS];
+
+	/* a vblank event is pending, with the bo to be posted on it */
+	int vblank_pending;
+	struct gralloc_drm_bo_t *queued_post;
+	drmModeClip queued_damage[GRALLOC_DRM_MAX_DAMAGE];
+	int queued_damage_count;
+
+	/* posts of a bo already on screen that were skipped */
+	unsigned int elided_posts;
+
+	/* vsync prediction and callbacks */
+	pthread_mutex_t vsync_mutex;
+	pthread_cond_t vsync_cond;
+	pthread_t vsync_thread;
+	int vsync_thread_started;
+	int vsync_quit;
+	clockid_t vsync_clock;	/* clock of the event timestamps */
+
 	/* plane support */
 	drmModePlaneResPtr plane_resources;
 	struct gralloc_drm_plane_t *planes;
+
+	/*
+	 * size of the primary swapchain; when smaller than the mode, it is
+	 * scaled up by the scaler plane over a black primary.bo
+	 */
+	uint32_t render_width, render_height;
+	struct gralloc_drm_plane_t *scaler;
+
+	/* render size changes, protected by vsync_mutex and event_mutex */
+	struct gralloc_drm_drs_t drs;
+	uint64_t plane_bandwidth;	/* bytes a crtc may fetch per frame, 0 for no limit */
+	int atomic;			/* atomic tests are available */
+
+	/* results of plane validation, by configuration */
+	pthread_mutex_t plane_check_mutex;
+	struct gralloc_drm_plane_check_t plane_checks[GRALLOC_DRM_PLANE_CHECK_CACHE_SIZE];
+
+	/* cursor images, by content */
+	pthread_mutex_t cursor_mutex;
+	uint32_t cursor_width, cursor_height;
+	struct gralloc_drm_cursor_t cursors[GRALLOC_DRM_CURSOR_CACHE_SIZE];
+	unsigned int cursor_stamp;
+
+	/* driver blits share state, such as a batch buffer */
+	pthread_mutex_t blit_mutex;
+
+	/* fb objects by bo, so that re-imported buffers reuse their fb */
+	pthread_mutex_t fb_cache_mutex;
+	struct gralloc_drm_fb_t fb_cache[GRALLOC_DRM_FB_CACHE_SIZE];
+	unsigned int fb_cache_stamp;
 };
 
 struct drm_module_t {
@@ -135,8 +424,62 @@ struct drm_module_t {
 		uint32_t dst_x, uint32_t dst_y, uint32_t dst_w, uint32_t dst_h,
 		uint32_t src_x, uint32_t src_y, uint32_t src_w, uint32_t src_h);
 	void (*hwc_disable_planes) (struct gralloc_drm_t *mod);
+	int (*hwc_reserve_display_plane) (struct gralloc_drm_t *mod,
+		int disp, buffer_handle_t handle, uint32_t id,
+		uint32_t dst_x, uint32_t dst_y, uint32_t dst_w, uint32_t dst_h,
+		uint32_t src_x, uint32_t src_y, uint32_t src_w, uint32_t src_h);
 	int (*hwc_set_plane_handle) (struct gralloc_drm_t *mod,
 		uint32_t id, buffer_handle_t handle);
+	int (*hwc_get_plane_count) (struct gralloc_drm_t *mod);
+	int (*hwc_get_plane_caps) (struct gralloc_drm_t *mod, int index,
+		struct gralloc_drm_plane_caps_t *caps);
+	int (*hwc_validate_plane) (struct gralloc_drm_t *mod,
+		int disp, uint32_t plane_id, buffer_handle_t handle,
+		uint32_t dst_x, uint32_t dst_y, uint32_t dst_w, uint32_t dst_h,
+		uint32_t src_x, uint32_t src_y, uint32_t src_w, uint32_t src_h);
+
+	/* HWC cursor API */
+	void (*hwc_get_cursor_size) (struct gralloc_drm_t *mod,
+		uint32_t *width, uint32_t *height);
+	int (*hwc_set_cursor) (struct gralloc_drm_t *mod, int disp,
+		buffer_handle_t handle, int hot_x, int hot_y);
+	int (*hwc_move_cursor) (struct gralloc_drm_t *mod, int disp,
+		int x, int y);
+
+	/* HWC render size API */
+	void (*hwc_get_render_size) (struct gralloc_drm_t *mod,
+		uint32_t *width, uint32_t *height);
+	int (*hwc_get_buffer_render_size) (struct gralloc_drm_t *mod,
+		buffer_handle_t handle, uint32_t *width, uint32_t *height);
+
+	/* HWC refresh rate API, rates in mHz */
+	int (*hwc_get_refresh_rates) (struct gralloc_drm_t *mod, int disp,
+		int *rates, int count);
+	int (*hwc_set_refresh_rate) (struct gralloc_drm_t *mod, int disp,
+		int rate);
+
+	/* HWC damage API */
+	int (*hwc_post_damage) (struct gralloc_drm_t *mod,
+		buffer_handle_t handle, const struct drm_clip_rect *rects,
+		int count);
+
+	/* HWC vsync API */
+	int (*hwc_get_next_vblank) (struct gralloc_drm_t *mod,
+		int disp, int64_t *timestamp);
+	int (*hwc_set_vsync_callback) (struct gralloc_drm_t *mod,
+		int disp, int64_t offset,
+		void (*callback)(void *data, int disp, int64_t timestamp),
+		void *data);
+
+	/* HWC shutdown API */
+	void (*hwc_shutdown) (struct gralloc_drm_t *mod);
+
+	/* HWC display event API */
+	int (*hwc_get_event_fd) (struct gralloc_drm_t *mod);
+	int (*hwc_handle_events) (struct gralloc_drm_t *mod);
+	void (*hwc_set_event_callbacks) (struct gralloc_drm_t *mod,
+		const struct gralloc_drm_event_callbacks_t *callbacks,
+		void *data);
 
 	pthread_mutex_t mutex;
 	struct gralloc_drm_t *drm;
@@ -176,6 +519,16 @@ struct gralloc_drm_drv_t {
 		     uint16_t src_x1, uint16_t src_y1,
 		     uint16_t src_x2, uint16_t src_y2);
 
+	/*
+	 * optional, blit between two bo's with scaling and format
+	 * conversion, return non-zero if it cannot be done
+	 */
+	int (*scale_blit)(struct gralloc_drm_drv_t *drv,
+			  struct gralloc_drm_bo_t *dst,
+			  struct gralloc_drm_bo_t *src,
+			  int dst_x, int dst_y, int dst_w, int dst_h,
+			  int src_x, int src_y, int src_w, int src_h);
+
 	/* query component offsets, strides and handles for a format */
 	void (*resolve_format)(struct gralloc_drm_drv_t *drv,
 		     struct gralloc_drm_bo_t *bo,
@@ -193,7 +546,13 @@ struct gralloc_drm_bo_t {
 	int lock_count;
 	int locked_for;
 
-	unsigned int refcount;
+	/*
+	 * part of the bo rendered to, recorded when the render size was
+	 * handed out for it; 0 for the whole bo
+	 */
+	uint32_t render_width, render_height;
+
+	volatile int32_t refcount;	/* atomic */
 };
 
 struct gralloc_drm_drv_t *gralloc_drm_drv_create_for_pipe(int fd, const char *name);
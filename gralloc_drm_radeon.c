@@ -323,16 +323,17 @@ static void drm_gem_radeon_unmap(struct gralloc_drm_drv_t *drv,
 static void drm_gem_radeon_init_kms_features(struct gralloc_drm_drv_t *drv,
 		struct gralloc_drm_t *drm)
 {
-	switch (drm->primary.fb_format) {
+	switch (drm->primary->fb_format) {
 	case HAL_PIXEL_FORMAT_BGRA_8888:
 	case HAL_PIXEL_FORMAT_RGB_565:
 		break;
 	default:
-		drm->primary.fb_format = HAL_PIXEL_FORMAT_BGRA_8888;
+		drm->primary->fb_format = HAL_PIXEL_FORMAT_BGRA_8888;
 		break;
 	}
 
 	drm->mode_quirk_vmwgfx = 0;
+	drm->mode_page_flip = 1;
 	drm->swap_mode = DRM_SWAP_FLIP;
 	drm->mode_sync_flip = 1;
 	drm->swap_interval = 1;
@@ -0,0 +1,351 @@
+/*
+ * Copyright (C) 2010-2011 Chia-I Wu <olvaffe@gmail.com>
+ * Copyright (C) 2010-2011 LunarG Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#define LOG_TAG "GRALLOC-SCALE"
+
+#include <cutils/log.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "gralloc_drm.h"
+#include "gralloc_drm_priv.h"
+
+/* bits of the bilinear weights, small enough for signed 16-bit SIMD */
+#define SCALE_WEIGHT_BITS 7
+
+/*
+ * Convert a row of pixels to 0xAARRGGBB.  Return -EINVAL for formats the
+ * CPU path does not handle.
+ */
+static int scale_fetch_row(int format, const unsigned char *src,
+		uint32_t *dst, int width)
+{
+	int x;
+
+	switch (format) {
+	case HAL_PIXEL_FORMAT_BGRA_8888:
+		memcpy(dst, src, width * 4);
+		break;
+	case HAL_PIXEL_FORMAT_RGBA_8888:
+	case HAL_PIXEL_FORMAT_RGBX_8888:
+		for (x = 0; x < width; x++) {
+			uint32_t p = ((const uint32_t *) src)[x];
+
+			dst[x] = (p & 0xff00ff00) |
+				((p & 0xff) << 16) | ((p >> 16) & 0xff);
+			if (format == HAL_PIXEL_FORMAT_RGBX_8888)
+				dst[x] |= 0xff000000;
+		}
+		break;
+	case HAL_PIXEL_FORMAT_RGB_565:
+		for (x = 0; x < width; x++) {
+			uint32_t p = ((const uint16_t *) src)[x];
+			uint32_t r = (p >> 11) & 0x1f;
+			uint32_t g = (p >> 5) & 0x3f;
+			uint32_t b = p & 0x1f;
+
+			dst[x] = 0xff000000 |
+				((r << 3 | r >> 2) << 16) |
+				((g << 2 | g >> 4) << 8) |
+				(b << 3 | b >> 2);
+		}
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/*
+ * Convert a row of 0xAARRGGBB pixels to a format.
+ */
+static void scale_store_row(int format, const uint32_t *src,
+		unsigned char *dst, int width)
+{
+	int x;
+
+	switch (format) {
+	case HAL_PIXEL_FORMAT_BGRA_8888:
+		memcpy(dst, src, width * 4);
+		break;
+	case HAL_PIXEL_FORMAT_RGBA_8888:
+	case HAL_PIXEL_FORMAT_RGBX_8888:
+		for (x = 0; x < width; x++) {
+			uint32_t p = src[x];
+
+			((uint32_t *) dst)[x] = (p & 0xff00ff00) |
+				((p & 0xff) << 16) | ((p >> 16) & 0xff);
+		}
+		break;
+	case HAL_PIXEL_FORMAT_RGB_565:
+		for (x = 0; x < width; x++) {
+			uint32_t p = src[x];
+
+			((uint16_t *) dst)[x] =
+				((p >> 8) & 0xf800) |
+				((p >> 5) & 0x07e0) |
+				((p >> 3) & 0x001f);
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+/*
+ * Interpolate between four pixels, with fx and fy in SCALE_WEIGHT_BITS.
+ */
+static inline uint32_t scale_lerp(uint32_t p00, uint32_t p01,
+		uint32_t p10, uint32_t p11, int fx, int fy)
+{
+#ifdef __SSE2__
+	const __m128i zero = _mm_setzero_si128();
+	/* the two columns of the top and the bottom rows, 16 bits a channel */
+	__m128i top = _mm_unpacklo_epi8(
+			_mm_cvtsi32_si128(p00), zero);
+	__m128i bot = _mm_unpacklo_epi8(
+			_mm_cvtsi32_si128(p10), zero);
+	__m128i v;
+
+	top = _mm_unpacklo_epi64(top,
+			_mm_unpacklo_epi8(_mm_cvtsi32_si128(p01), zero));
+	bot = _mm_unpacklo_epi64(bot,
+			_mm_unpacklo_epi8(_mm_cvtsi32_si128(p11), zero));
+
+	/* vertically, then horizontally */
+	v = _mm_add_epi16(top, _mm_srai_epi16(_mm_mullo_epi16(
+			_mm_sub_epi16(bot, top), _mm_set1_epi16(fy)),
+			SCALE_WEIGHT_BITS));
+	v = _mm_add_epi16(v, _mm_srai_epi16(_mm_mullo_epi16(
+			_mm_sub_epi16(_mm_srli_si128(v, 8), v),
+			_mm_set1_epi16(fx)), SCALE_WEIGHT_BITS));
+
+	return _mm_cvtsi128_si32(_mm_packus_epi16(v, zero));
+#else
+	uint32_t p = 0;
+	int shift;
+
+	for (shift = 0; shift < 32; shift += 8) {
+		int c00 = (p00 >> shift) & 0xff, c01 = (p01 >> shift) & 0xff;
+		int c10 = (p10 >> shift) & 0xff, c11 = (p11 >> shift) & 0xff;
+		int c0 = c00 + (((c10 - c00) * fy) >> SCALE_WEIGHT_BITS);
+		int c1 = c01 + (((c11 - c01) * fy) >> SCALE_WEIGHT_BITS);
+		int c = c0 + (((c1 - c0) * fx) >> SCALE_WEIGHT_BITS);
+
+		p |= (uint32_t) c << shift;
+	}
+
+	return p;
+#endif
+}
+
+/*
+ * Return the 16.16 source coordinate of the center of a destination pixel,
+ * clamped to the source.
+ */
+static inline int scale_coord(int d, int src_len, int dst_len)
+{
+	int64_t s = (((int64_t) (2 * d + 1) * src_len << 16) / dst_len -
+			(1 << 16)) / 2;
+
+	if (s < 0)
+		s = 0;
+	if (s > (int64_t) (src_len - 1) << 16)
+		s = (int64_t) (src_len - 1) << 16;
+
+	return (int) s;
+}
+
+/*
+ * Scale and convert a rectangle with the CPU, using bilinear filtering.
+ */
+static int scale_cpu(struct gralloc_drm_bo_t *dst, struct gralloc_drm_bo_t *src,
+		int dst_x, int dst_y, int dst_w, int dst_h,
+		int src_x, int src_y, int src_w, int src_h)
+{
+	int src_bpp = gralloc_drm_get_bpp(src->handle->format);
+	int dst_bpp = gralloc_drm_get_bpp(dst->handle->format);
+	uint32_t *rows[2], *out;
+	int *xs, row_y[2] = { -1, -1 };
+	void *src_addr, *dst_addr;
+	int x, y, err;
+
+	if ((src_bpp != 2 && src_bpp != 4) || (dst_bpp != 2 && dst_bpp != 4))
+		return -EINVAL;
+
+	rows[0] = malloc(src_w * 4);
+	rows[1] = malloc(src_w * 4);
+	out = malloc(dst_w * 4);
+	xs = malloc(dst_w * sizeof(*xs));
+	if (!rows[0] || !rows[1] || !out || !xs) {
+		err = -ENOMEM;
+		goto free;
+	}
+
+	for (x = 0; x < dst_w; x++)
+		xs[x] = scale_coord(x, src_w, dst_w);
+
+	err = gralloc_drm_bo_lock(src, GRALLOC_USAGE_SW_READ_OFTEN,
+			src_x, src_y, src_w, src_h, &src_addr);
+	if (err)
+		goto free;
+	err = gralloc_drm_bo_lock(dst, GRALLOC_USAGE_SW_WRITE_OFTEN,
+			dst_x, dst_y, dst_w, dst_h, &dst_addr);
+	if (err) {
+		gralloc_drm_bo_unlock(src);
+		goto free;
+	}
+
+	for (y = 0; y < dst_h; y++) {
+		int sy = scale_coord(y, src_h, dst_h);
+		int y0 = sy >> 16;
+		int y1 = (y0 + 1 < src_h) ? y0 + 1 : y0;
+		int fy = (sy & 0xffff) >> (16 - SCALE_WEIGHT_BITS);
+		unsigned char *dst_row;
+		uint32_t *bottom;
+
+		/* the top row is often the bottom row of the previous line */
+		if (row_y[0] != y0 && row_y[1] == y0) {
+			uint32_t *tmp = rows[0];
+
+			rows[0] = rows[1];
+			rows[1] = tmp;
+			row_y[1] = row_y[0];
+			row_y[0] = y0;
+		}
+
+		if (row_y[0] != y0) {
+			err = scale_fetch_row(src->handle->format,
+				(const unsigned char *) src_addr +
+				(src_y + y0) * src->handle->stride +
+				src_x * src_bpp, rows[0], src_w);
+			row_y[0] = y0;
+		}
+
+		if (!err && y1 != y0 && row_y[1] != y1) {
+			err = scale_fetch_row(src->handle->format,
+				(const unsigned char *) src_addr +
+				(src_y + y1) * src->handle->stride +
+				src_x * src_bpp, rows[1], src_w);
+			row_y[1] = y1;
+		}
+
+		if (err)
+			break;
+
+		bottom = (y1 != y0) ? rows[1] : rows[0];
+
+		for (x = 0; x < dst_w; x++) {
+			int x0 = xs[x] >> 16;
+			int x1 = (x0 + 1 < src_w) ? x0 + 1 : x0;
+			int fx = (xs[x] & 0xffff) >> (16 - SCALE_WEIGHT_BITS);
+
+			out[x] = scale_lerp(rows[0][x0], rows[0][x1],
+					bottom[x0], bottom[x1], fx, fy);
+		}
+
+		dst_row = (unsigned char *) dst_addr +
+			(dst_y + y) * dst->handle->stride + dst_x * dst_bpp;
+		scale_store_row(dst->handle->format, out, dst_row, dst_w);
+	}
+
+	gralloc_drm_bo_unlock(dst);
+	gralloc_drm_bo_unlock(src);
+
+free:
+	free(rows[0]);
+	free(rows[1]);
+	free(out);
+	free(xs);
+
+	return err;
+}
+
+/*
+ * Copy a rectangle of src to a rectangle of the same size in dst with the
+ * driver blit.  Blits may come from the posting, event and hdmi clone
+ * threads, and the driver state they share is not thread-safe.
+ */
+void gralloc_drm_bo_blit(struct gralloc_drm_bo_t *dst,
+		struct gralloc_drm_bo_t *src,
+		uint16_t dst_x1, uint16_t dst_y1, uint16_t dst_x2, uint16_t dst_y2,
+		uint16_t src_x1, uint16_t src_y1, uint16_t src_x2, uint16_t src_y2)
+{
+	struct gralloc_drm_t *drm = dst->drm;
+
+	pthread_mutex_lock(&drm->blit_mutex);
+	drm->drv->blit(drm->drv, dst, src,
+			dst_x1, dst_y1, dst_x2, dst_y2,
+			src_x1, src_y1, src_x2, src_y2);
+	pthread_mutex_unlock(&drm->blit_mutex);
+}
+
+/*
+ * Copy a rectangle of src to a rectangle of dst, scaling and converting
+ * the format as needed.  The driver does it when it can; a same-size copy
+ * falls back to the plain driver blit, and anything else to the CPU.
+ */
+int gralloc_drm_bo_scale(struct gralloc_drm_bo_t *dst,
+		struct gralloc_drm_bo_t *src,
+		int dst_x, int dst_y, int dst_w, int dst_h,
+		int src_x, int src_y, int src_w, int src_h)
+{
+	struct gralloc_drm_drv_t *drv = dst->drm->drv;
+
+	if (dst_w <= 0 || dst_h <= 0 || src_w <= 0 || src_h <= 0 ||
+	    dst_x < 0 || dst_y < 0 || src_x < 0 || src_y < 0 ||
+	    dst_x + dst_w > dst->handle->width ||
+	    dst_y + dst_h > dst->handle->height ||
+	    src_x + src_w > src->handle->width ||
+	    src_y + src_h > src->handle->height)
+		return -EINVAL;
+
+	if (drv->scale_blit) {
+		int err;
+
+		pthread_mutex_lock(&dst->drm->blit_mutex);
+		err = drv->scale_blit(drv, dst, src,
+				dst_x, dst_y, dst_w, dst_h,
+				src_x, src_y, src_w, src_h);
+		pthread_mutex_unlock(&dst->drm->blit_mutex);
+		if (!err)
+			return 0;
+	}
+
+	if (drv->blit && dst_w == src_w && dst_h == src_h &&
+	    dst->handle->format == src->handle->format) {
+		gralloc_drm_bo_blit(dst, src,
+			dst_x, dst_y, dst_x + dst_w, dst_y + dst_h,
+			src_x, src_y, src_x + src_w, src_y + src_h);
+		return 0;
+	}
+
+	return scale_cpu(dst, src, dst_x, dst_y, dst_w, dst_h,
+			src_x, src_y, src_w, src_h);
+}